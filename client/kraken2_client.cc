@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <chrono>
@@ -7,6 +8,8 @@
 #include <random>
 #include <thread>
 #include <sysexits.h>
+#include <sys/resource.h>
+#include <unistd.h>
 
 #include <grpc/grpc.h>
 #include <grpc++/channel.h>
@@ -16,6 +19,7 @@
 
 #include "utils.h"
 #include "thread_safe_queue.h"
+#include "shared_ring.h"
 #include "Kraken2.grpc.pb.h"
 
 #include <zlib.h>
@@ -26,11 +30,17 @@ using namespace std::chrono_literals; // ns, us, ms, s, h, etc.
 
 using grpc::Channel;
 using grpc::ClientContext;
+using grpc::ClientReader;
 using grpc::ClientReaderWriter;
+using grpc::ClientReaderWriterInterface;
 using grpc::ClientWriter;
 using grpc::Status;
 using grpc::WriteOptions;
 
+using kraken2proto::Kraken2ClassificationSettings;
+using kraken2proto::Kraken2ClassifyRequest;
+using kraken2proto::Kraken2ClassifyResult;
+using kraken2proto::Kraken2Hitlist;
 using kraken2proto::Kraken2ReadyRequest;
 using kraken2proto::Kraken2ReadyResult;
 using kraken2proto::Kraken2SequenceRequest;
@@ -39,10 +49,15 @@ using kraken2proto::Kraken2SequenceResult;
 using kraken2proto::Kraken2SequenceResultMulti;
 using kraken2proto::Kraken2SequenceStreamResult;
 using kraken2proto::Kraken2Service;
+using kraken2proto::Kraken2PackedResults;
+using kraken2proto::Kraken2TaxonomyRequest;
+using kraken2proto::Kraken2TaxonomyTable;
 using kraken2proto::Kraken2SummaryRequest;
 using kraken2proto::Kraken2SummaryResults;
 using kraken2proto::Kraken2ShutdownRequest;
 using kraken2proto::Kraken2ShutdownResult;
+using kraken2proto::Kraken2SharedMemoryRequest;
+using kraken2proto::Kraken2SharedMemoryResult;
 
 // Command line options
 struct Options
@@ -52,9 +67,84 @@ struct Options
     std::string host = "localhost";
     int port = 8080;
     bool shutdown = false;
+    Kraken2SequenceRequestMulti::HitlistFormat hitlist_format = Kraken2SequenceRequestMulti::HITLIST_TEXT;
+    bool ordered = false;
+    bool packed = false;
+    int quality_mask = 0;
+    Kraken2SequenceRequestMulti::ResultFormat result_format = Kraken2SequenceRequestMulti::RESULT_FULL;
+    std::string taxonomy_file;
+    grpc_compression_algorithm request_compression = GRPC_COMPRESS_NONE;
+    std::string unix_socket;
+    uint64_t shared_memory_mb = 0;
+    // sent with each request, fields left unset keep the server's defaults
+    Kraken2ClassificationSettings settings;
+    std::string sample;
+    uint32_t priority = 0;
+    int latency_requests = 0;
+    int latency_reads = 10;
 };
 
-typedef std::shared_ptr<ClientReaderWriter<Kraken2SequenceRequestMulti, Kraken2SequenceStreamResult>> ClientStream;
+// A gRPC stream, or the rings of a shared memory segment
+typedef std::shared_ptr<ClientReaderWriterInterface<Kraken2SequenceRequestMulti, Kraken2SequenceStreamResult>> ClientStream;
+
+
+/**
+ * @brief A classification stream through rings in a shared memory segment, for a server
+ *        on the same host. A ClassifySharedMemory call names the segment to the server
+ *        and lasts as long as the stream, waits on the rings give up once it returns.
+ */
+class SharedMemoryClientStream final
+    : public ClientReaderWriterInterface<Kraken2SequenceRequestMulti, Kraken2SequenceStreamResult> {
+
+public:
+    SharedMemoryClientStream(Kraken2Service::Stub *stub, uint64_t ring_bytes) {
+        static std::atomic<int> n_segments = 0;
+        segment = SharedMemorySegment::Create(
+            "/kraken2-" + std::to_string(getpid()) + "-" + std::to_string(n_segments++), ring_bytes);
+        req.set_name(segment->name());
+        call = std::async(
+            std::launch::async, [this, stub] { return stub->ClassifySharedMemory(&context, req, &response); });
+        cancelled = [this] { return call.wait_for(0s) == std::future_status::ready; };
+    }
+
+    ~SharedMemoryClientStream() {
+        if (call.valid()) {
+            context.TryCancel();
+            call.wait();
+        }
+    }
+
+    void WaitForInitialMetadata() override {}
+
+    bool NextMessageSize(uint32_t *sz) override {
+        return segment->results().NextMessageSize(sz, cancelled);
+    }
+
+    bool Read(Kraken2SequenceStreamResult *msg) override {
+        return segment->results().Read(msg, cancelled);
+    }
+
+    bool Write(const Kraken2SequenceRequestMulti &msg, WriteOptions options) override {
+        return segment->requests().Write(msg, cancelled);
+    }
+
+    bool WritesDone() override {
+        segment->requests().Close();
+        return true;
+    }
+
+    Status Finish() override {
+        return call.get();
+    }
+
+private:
+    std::unique_ptr<SharedMemorySegment> segment;
+    ClientContext context;
+    Kraken2SharedMemoryRequest req;
+    Kraken2SharedMemoryResult response;
+    std::future<Status> call;
+    CancelledCheck cancelled;
+};
 
 
 #define ST_BATCH_SIZE 2000     // reads in a gRPC batch
@@ -65,7 +155,8 @@ typedef std::shared_ptr<ClientReaderWriter<Kraken2SequenceRequestMulti, Kraken2S
 class SequenceClient {
 
 public:
-    SequenceClient(std::shared_ptr<Channel> channel) : sequence_stub(Kraken2Service::NewStub(channel)) {}
+    SequenceClient(std::shared_ptr<Channel> channel, const Options &opts)
+        : sequence_stub(Kraken2Service::NewStub(channel)), opts(opts) {}
 
 
     /**
@@ -83,12 +174,29 @@ public:
 
         ClientContext context;
         Kraken2SequenceResultMulti response;
-        ClientStream stream(sequence_stub->ClassifyStream(&context));
+        ClientStream stream;
+        if (opts.shared_memory_mb > 0) {
+            try {
+                stream = std::make_shared<SharedMemoryClientStream>(
+                    sequence_stub.get(), opts.shared_memory_mb * 1024 * 1024);
+            }
+            catch (const std::exception &ex) {
+                std::cerr << "Failed to set up shared memory: " << ex.what() << std::endl;
+                return EX_IOERR;
+            }
+        }
+        else {
+            stream = ClientStream(sequence_stub->ClassifyStream(&context));
+        }
         std::atomic<uint64_t> seqs_in_flight = 0;
+        // cleared once no more results will come, so sending stops rather
+        // than waiting on reads the server will not return
+        std::atomic<bool> receiving = true;
 
-        // queue for gRPC messages (i.e. sequence reads)
+        // queue for gRPC messages (i.e. sequence reads), the file reader blocks
+        // when it is full and closes it at the end of the file
         ThreadSafeQueue<std::vector<Kraken2SequenceRequest>>
-            *batches_queue = new ThreadSafeQueue<std::vector<Kraken2SequenceRequest>>();
+            *batches_queue = new ThreadSafeQueue<std::vector<Kraken2SequenceRequest>>(MAX_BATCHES);
 
         // reads data from file into queue
         std::future<int> fastq_batches = std::async(
@@ -98,13 +206,13 @@ public:
         // take data from queue and send over gRPC
         std::future<int> stream_batches = std::async(
             std::launch::async, &SequenceClient::StreamWriter, this,
-            std::ref(fastq_batches), std::ref(seqs_in_flight),
+            std::ref(seqs_in_flight), std::ref(receiving),
             batches_queue, std::ref(stream));
 
         // reading back results on gRPC stream
         std::future<int> recv_reads = std::async(
             std::launch::async, &SequenceClient::StreamReader, this,
-            std::ref(seqs_in_flight), std::ref(report_file), std::ref(stream));
+            std::ref(seqs_in_flight), std::ref(receiving), std::ref(report_file), std::ref(stream));
 
         // wait for things to finish in order
         fastq_batches.wait();
@@ -115,17 +223,85 @@ public:
         delete batches_queue;
         std::cerr << "Sent    : " << stream_batches.get() << std:: endl;
         std::cerr << "Received: " << recv_reads.get() << std::endl;
-        assert(seqs_in_flight==0);
+        // with the byte counts, to weigh compression against bandwidth
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        std::cerr << "CPU seconds: "
+                  << usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+                     + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6 << std::endl;
 
         // Handle the stream response
         Status status = stream->Finish();
         if (!status.ok()) {
             std::cerr << "Client RPC stream failed: " << status.error_message() << std::endl;
         }
+        else {
+            assert(seqs_in_flight==0);
+        }
     
         return status.error_code();
     }
 
+    /**
+     * @brief Time requests made of the first reads of a file, sent in a Classify call, in
+     *        one asking for a report too, and in a ClassifyStream opened for each. The p50
+     *        and p99 latencies of each are printed.
+     *
+     * @return EX_IOERR if sequences could not be read
+     * @return else gRPC status code of the first failed request
+     */
+    int MeasureLatency(const std::string &sequence_name, int n_requests, int n_reads) {
+        int state = WaitForServer();
+        if (state != 0) {return state;}
+
+        std::vector<Kraken2SequenceRequest> seqs;
+        try {
+            FastReader reader = FastReader(sequence_name, opts.packed, opts.quality_mask);
+            reader.read(seqs, n_reads);
+        }
+        catch (const std::exception &ex) {
+            std::cerr << "Failed to read sequences from file: " << sequence_name
+                      << ": " << ex.what() << std::endl;
+            return EX_IOERR;
+        }
+        Kraken2ClassifyRequest req;
+        Kraken2SequenceRequestMulti &multi = *req.mutable_sequences();
+        multi.set_hitlist_format(opts.hitlist_format);
+        multi.set_result_format(opts.result_format);
+        *multi.mutable_settings() = opts.settings;
+        multi.set_priority(opts.priority);
+        multi.mutable_seqs()->Assign(seqs.begin(), seqs.end());
+        std::cerr << "Timing " << n_requests << " requests of " << seqs.size() << " sequences." << std::endl;
+
+        // the three are interleaved so each sees the server in the same state
+        std::vector<double> unary, unary_report, stream;
+        for (int i = 0; i < n_requests; ++i) {
+            for (auto *times : {&unary, &unary_report, &stream}) {
+                auto start = std::chrono::steady_clock::now();
+                Status status;
+                if (times == &stream) {
+                    status = StreamOnce(multi);
+                }
+                else {
+                    ClientContext context;
+                    Kraken2ClassifyResult result;
+                    req.set_report(times == &unary_report);
+                    status = sequence_stub->Classify(&context, req, &result);
+                }
+                if (!status.ok()) {
+                    std::cerr << "Request failed: " << status.error_message() << std::endl;
+                    return status.error_code();
+                }
+                times->push_back(std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start).count());
+            }
+        }
+        PrintLatency("Classify", unary);
+        PrintLatency("Classify with report", unary_report);
+        PrintLatency("ClassifyStream", stream);
+        return 0;
+    }
+
     /**
      * @brief Request a summary of the classification history on the server.
      *
@@ -145,6 +321,41 @@ public:
         return status.error_code();
     }
 
+    /**
+     * @brief Fetch the taxonomy of the server's database and write it as a
+     *        tab separated table of ID, parent ID, rank and name.
+     *
+     * @return gRPC status code of request
+     */
+    int GetTaxonomy(const std::string &taxonomy_file) {
+        ClientContext context;
+        Kraken2TaxonomyRequest req;
+        Kraken2TaxonomyTable table;
+        std::ofstream out(taxonomy_file);
+        if (!out) {
+            std::cerr << "Failed to open taxonomy file: " << taxonomy_file << std::endl;
+            return grpc::StatusCode::INVALID_ARGUMENT;
+        }
+        size_t n_nodes = 0;
+        std::unique_ptr<ClientReader<Kraken2TaxonomyTable>> reader(
+            sequence_stub->GetTaxonomy(&context, req));
+        while (reader->Read(&table)) {
+            for (int i = 0; i < table.tax_ids_size(); ++i) {
+                out << table.tax_ids(i) << '\t' << table.parent_ids(i) << '\t'
+                    << table.ranks(i) << '\t' << table.names(i) << '\n';
+            }
+            n_nodes += table.tax_ids_size();
+        }
+        Status status = reader->Finish();
+        if (!status.ok()) {
+            std::cerr << "Could not retrieve taxonomy: " << status.error_message() << std::endl;
+        }
+        else {
+            std::cerr << "Wrote " << n_nodes << " taxa to " << taxonomy_file << std::endl;
+        }
+        return status.error_code();
+    }
+
     /**
      * @brief Shutdown the server remotely
      *
@@ -168,60 +379,79 @@ public:
     }
 
     int StreamWriter(
-            std::future<int> &total_batches,
-            std::atomic<uint64_t> &seqs_in_flight,
+            std::atomic<uint64_t> &seqs_in_flight, std::atomic<bool> &receiving,
             ThreadSafeQueue<std::vector<Kraken2SequenceRequest>> *batches,
             ClientStream &writer) {
         int seqs_sent = 0;
+        uint64_t n_bytes = 0;
         try {
-            while (!(
-                // we've finished if we've received the signal AND theres nothing left
-                total_batches.wait_for(0s) == std::future_status::ready
-                && batches->size() == 0
-            )) {
-                std::optional<std::vector<Kraken2SequenceRequest>> item = batches->pop();
-                if (item.has_value()) {
-                    std::vector<Kraken2SequenceRequest> batch = item.value();
-                    bool show_msg = true;
-                    while (true) {
-                        if ((seqs_in_flight + batch.size() >= MAX_IN_FLIGHT)) {
-                            std::this_thread::sleep_for(10ms);
-                            if (show_msg) {
-                                show_msg = false;
-                                std::cerr << "Waiting before sending more. In-flight: " << seqs_in_flight << "." << std::endl;
-                            }
-                            continue;
+            // pop() waits for a batch and returns nothing once the reader
+            // has closed the queue and it is drained
+            while (std::optional<std::vector<Kraken2SequenceRequest>> item = batches->pop()) {
+                std::vector<Kraken2SequenceRequest> batch = std::move(*item);
+                bool show_msg = true;
+                while (receiving) {
+                    if ((seqs_in_flight + batch.size() >= MAX_IN_FLIGHT)) {
+                        std::this_thread::sleep_for(10ms);
+                        if (show_msg) {
+                            show_msg = false;
+                            std::cerr << "Waiting before sending more. In-flight: " << seqs_in_flight << "." << std::endl;
                         }
-                        else { break; }
+                        continue;
                     }
-                    
-                    // rebatch to smaller batches for stream
-                    const uint64_t MAX_SIZE = 128 * 1024 * 1024;
-                    for(size_t i = 0; i < batch.size(); i += ST_BATCH_SIZE) {
-                        auto last = std::min(batch.size(), i + ST_BATCH_SIZE);
-                        size_t bsize = last - i;
-                        Kraken2SequenceRequestMulti req;
-                        req.mutable_seqs()->Assign(batch.begin() + i, batch.begin() + last);
-                        uint64_t msg_size = req.ByteSizeLong();
-                        if (msg_size > MAX_SIZE) {
-                            // send one by one
-                            for (size_t k = i; k<last; ++k) {
-                                Kraken2SequenceRequestMulti req;
-                                req.mutable_seqs()->Assign(batch.begin() + k, batch.begin() + k + 1);
-                                if (req.ByteSizeLong() > MAX_SIZE) {
-                                    std::cerr << "Read is too large! Skipping." << std::endl;
-                                    continue;
-                                }
-                                writer->Write(req, WriteOptions().set_buffer_hint());
-                                seqs_in_flight.fetch_add(1);
-                                seqs_sent++;
+                    else { break; }
+                }
+                if (!receiving) {
+                    std::cerr << "No more results are coming, sending stopped." << std::endl;
+                    // release the file reader if it is waiting for space
+                    batches->close();
+                    break;
+                }
+                
+                // rebatch to smaller batches for stream, which must also fit
+                // a shared memory ring along with their length
+                uint64_t MAX_SIZE = 128 * 1024 * 1024;
+                if (opts.shared_memory_mb > 0) {
+                    MAX_SIZE = std::min(MAX_SIZE, opts.shared_memory_mb * 1024 * 1024 - sizeof(uint32_t));
+                }
+                for(size_t i = 0; i < batch.size(); i += ST_BATCH_SIZE) {
+                    auto last = std::min(batch.size(), i + ST_BATCH_SIZE);
+                    size_t bsize = last - i;
+                    Kraken2SequenceRequestMulti req;
+                    req.set_hitlist_format(opts.hitlist_format);
+                    req.set_ordered(opts.ordered);
+                    req.set_result_format(opts.result_format);
+                    *req.mutable_settings() = opts.settings;
+                    req.set_sample(opts.sample);
+                    req.set_priority(opts.priority);
+                    req.mutable_seqs()->Assign(batch.begin() + i, batch.begin() + last);
+                    uint64_t msg_size = req.ByteSizeLong();
+                    if (msg_size > MAX_SIZE) {
+                        // send one by one
+                        for (size_t k = i; k<last; ++k) {
+                            Kraken2SequenceRequestMulti req;
+                            req.set_hitlist_format(opts.hitlist_format);
+                            req.set_ordered(opts.ordered);
+                            req.set_result_format(opts.result_format);
+                            *req.mutable_settings() = opts.settings;
+                            req.set_sample(opts.sample);
+                            req.set_priority(opts.priority);
+                            req.mutable_seqs()->Assign(batch.begin() + k, batch.begin() + k + 1);
+                            if (req.ByteSizeLong() > MAX_SIZE) {
+                                std::cerr << "Read is too large! Skipping." << std::endl;
+                                continue;
                             }
+                            n_bytes += req.ByteSizeLong();
+                            writer->Write(req, WriteOptions().set_buffer_hint());
+                            seqs_in_flight.fetch_add(1);
+                            seqs_sent++;
                         }
-                        else {
-                            writer->Write(req);
-                            seqs_in_flight.fetch_add(bsize);
-                            seqs_sent += bsize;
-                        }
+                    }
+                    else {
+                        n_bytes += msg_size;
+                        writer->Write(req);
+                        seqs_in_flight.fetch_add(bsize);
+                        seqs_sent += bsize;
                     }
                 }
             }
@@ -229,27 +459,45 @@ public:
         catch (const std::exception &ex) {
             std::cerr << "Failed to send sequences"
                       << ": " << ex.what() << std::endl;
+            // release the file reader if it is waiting for space
+            batches->close();
             writer->WritesDone();
             return seqs_sent;
         }
 
         writer->WritesDone();
+        std::cerr << "Request bytes: " << n_bytes << std::endl;
         return seqs_sent;
     }
 
     int StreamReader(
-            std::atomic<uint64_t> &seqs_in_flight, const std::string &report_file,
-            ClientStream &reader) {
+            std::atomic<uint64_t> &seqs_in_flight, std::atomic<bool> &receiving,
+            const std::string &report_file, ClientStream &reader) {
         Kraken2SequenceStreamResult result;
         int n_reads = 0;
+        uint64_t n_bytes = 0;
         try {
             while (reader->Read(&result)) {
+                n_bytes += result.ByteSizeLong();
                 if (result.has_classifications()) {
                     for (auto &res : result.classifications().classes()){
                         n_reads++;
                         PrintClassification(res);
                         seqs_in_flight--;
                     }
+                    const Kraken2PackedResults &packed = result.classifications().packed();
+                    for (int i = 0; i < packed.ids_size(); ++i) {
+                        n_reads++;
+                        PrintPackedClassification(packed, i);
+                        seqs_in_flight--;
+                    }
+                }
+                else if (result.has_summary() && !result.sample().empty()) {
+                    // reported before the whole stream, alongside its report
+                    std::cerr << "Received report for sample " << result.sample() << std::endl;
+                    if (!report_file.empty()) {
+                        PrintSummary(result.summary(), report_file + "." + result.sample());
+                    }
                 }
                 else if (result.has_summary()) {
                     PrintSummary(result.summary(), report_file);
@@ -262,8 +510,11 @@ public:
         catch (const std::exception &ex) {
             std::cerr << "Failed to receive responses"
                       << ": " << ex.what() << std::endl;
+            receiving = false;
             return n_reads;
         }
+        receiving = false;
+        std::cerr << "Response bytes: " << n_bytes << std::endl;
         return n_reads;
     }
     
@@ -272,21 +523,16 @@ public:
             ThreadSafeQueue<std::vector<Kraken2SequenceRequest>> *batches_queue) {
         int n_batches = 0;
         try {
-            FastReader reader = FastReader(sequence_file);
+            FastReader reader = FastReader(sequence_file, opts.packed, opts.quality_mask);
         
             std::cerr << "Reading sequences from file: " << sequence_file << std::endl;
             while (true) {
-                if ((batches_queue->size() >= MAX_BATCHES)) {
-                    std::cerr << "Waiting before reading new read batch." << std::endl;
-                    std::this_thread::sleep_for(10ms);
-                    continue;
-                }
- 
                 std::vector<Kraken2SequenceRequest> seqs;
                 int n_reads;
                 if ((n_reads = reader.read(seqs, FASTQ_BATCH_SIZE)) > 0) {
+                    // closed once no more results will be received, stop reading
+                    if (!batches_queue->push(std::move(seqs))) break;
                     n_batches++;
-                    batches_queue->push(std::move(seqs));
                 }
                 else { break; }
             }
@@ -295,6 +541,7 @@ public:
             std::cerr << "Failed to read sequences from file: " << sequence_file
                       << ": " << ex.what() << std::endl;
         }
+        batches_queue->close();
         return n_batches;
     }
 
@@ -303,6 +550,28 @@ private:
 
     // The gRPC service stub for the service defined in Kraken2.proto
     std::unique_ptr<kraken2proto::Kraken2Service::Stub> sequence_stub;
+    Options opts;
+
+    // Classify one message on a stream of its own, as a client with a few reads would
+    Status StreamOnce(const Kraken2SequenceRequestMulti &multi) {
+        ClientContext context;
+        ClientStream stream(sequence_stub->ClassifyStream(&context));
+        stream->Write(multi);
+        stream->WritesDone();
+        Kraken2SequenceStreamResult result;
+        while (stream->Read(&result)) {}
+        return stream->Finish();
+    }
+
+    void PrintLatency(const std::string &name, std::vector<double> &times) {
+        if (times.empty()) {
+            return;
+        }
+        std::sort(times.begin(), times.end());
+        size_t p99 = std::max<size_t>(1, (times.size() * 99 + 99) / 100) - 1;
+        std::cout << name << " latency ms: p50 " << times[(times.size() - 1) / 2]
+                  << ", p99 " << times[p99] << std::endl;
+    }
 
     int WaitForServer() {
         // wait for server
@@ -361,14 +630,68 @@ private:
      *
      * @param classification
      */
-    void PrintClassification(Kraken2SequenceResult classification) {
+    void PrintClassification(const Kraken2SequenceResult &classification) {
         std::string classified = classification.classified() ? "C" : "U";
         std::cout
             << classified << '\t'
             << classification.id() << '\t'
             << classification.tax_id() << '\t'
-            << classification.size() << '\t'
-            << classification.hitlist() << std::endl;
+            << classification.size() << '\t';
+        if (classification.has_packed_hitlist()) {
+            PrintPackedHitlist(classification.packed_hitlist());
+        }
+        else {
+            std::cout << classification.hitlist();
+        }
+        std::cout << std::endl;
+    }
+
+    /**
+     * @brief Print entry i of packed classifications, as PrintClassification.
+     *
+     * @param packed
+     * @param i
+     */
+    void PrintPackedClassification(const Kraken2PackedResults &packed, int i) {
+        std::cout
+            << (packed.classified(i) ? "C" : "U") << '\t'
+            << packed.ids(i) << '\t'
+            << packed.tax_ids(i) << '\t'
+            << packed.sizes(i) << '\t';
+        if (i < packed.packed_hitlists_size()) {
+            PrintPackedHitlist(packed.packed_hitlists(i));
+        }
+        else if (i < packed.hitlists_size()) {
+            std::cout << packed.hitlists(i);
+        }
+        std::cout << std::endl;
+    }
+
+    /**
+     * @brief Print a run-length encoded hitlist in the same form as the text hitlist.
+     *
+     * @param hitlist
+     */
+    void PrintPackedHitlist(const Kraken2Hitlist &hitlist) {
+        for (int i = 0; i < hitlist.codes_size(); ++i) {
+            if (i > 0) {
+                std::cout << ' ';
+            }
+            uint64_t code = hitlist.codes(i);
+            if (code == 0) {
+                std::cout << "A:" << hitlist.counts(i);
+            }
+            else if (code == 1) {
+                std::cout << "-:-";
+            }
+            else {
+                std::cout << code - 2 << ':' << hitlist.counts(i);
+            }
+        }
+        // the text hitlist ends with a space when its last run is ambiguous
+        if (hitlist.codes_size() > 0 && hitlist.codes(hitlist.codes_size() - 1) == 0) {
+            std::cout << ' ';
+        }
     }
 };
 
@@ -381,12 +704,50 @@ void Usage(int exit_code) {
               << "\t-i, -I  --host-ip            Server IP address (default: localhost)." << std::endl
               << "\t-p, -P, --port [num]         Server port (default: 8080)." << std::endl
               << "\t-k, -K, --shutdown           Shutdown server" << std::endl
+              << "\t    --hitlist [text|packed|none]  Hitlist returned by the server (default: text)." << std::endl
+              << "\t    --ordered                Output classifications in the order of the sequence file." << std::endl
+              << "\t    --encoding [text|packed] Send sequences as text records or packed 2 bits per base without qualities, so the minimum base quality is ignored (default: text)." << std::endl
+              << "\t    --quality-mask [int]     With packed encoding, mask bases below this quality before sending (default: 0, off)." << std::endl
+              << "\t    --results [full|packed]  Classifications returned with taxon names, or packed without (default: full)." << std::endl
+              << "\t    --taxonomy [path]        Write the server's taxonomy (ID, parent, rank, name) to this file." << std::endl
+              << "\t    --request-compression [none|deflate|gzip]  Compress requests with this algorithm (default: none)." << std::endl
+              << "\t    --unix-socket [path]     Connect to the server on this unix domain socket instead of host and port." << std::endl
+              << "\t    --shared-memory [int]    Exchange sequences and results with a server on the same host through shared memory rings of this many MB each, e.g. 256." << std::endl
+              << "\t    --confidence [double]    Confidence score threshold (0 - 1), overriding the server's." << std::endl
+              << "\t    --hit-groups [int]       Minimum number of hit groups needed to make a call, overriding the server's." << std::endl
+              << "\t    --min-quality [int]      Minimum base quality used in classification, overriding the server's." << std::endl
+              << "\t    --report-kmer [yes|no]   Include distinct k-mers in the report, overriding the server's." << std::endl
+              << "\t    --sample [tag]           Tag the sequences as one sample, its report is also written to the report path plus \".tag\"." << std::endl
+              << "\t    --priority [int]         Priority of the stream on the server, urgent work runs ahead of bulk streams (default: 0, capped by the server)." << std::endl
+              << "\t    --latency [int]          Instead of classifying the file, time this many requests of its first sequences as unary calls and as streams." << std::endl
+              << "\t    --latency-reads [int]    Sequences in each request timed by --latency (default: 10)." << std::endl
               << std::endl
-              << "Leave sequence blank to request the total summary data from the specified endpoint." << std::endl
+              << "Leave sequence blank to request the total summary data from the specified endpoint, or only the taxonomy if given." << std::endl
               << std::endl;
     exit(exit_code);
 }
 
+// Options without a short form, values chosen outside of the char range
+enum LongOnlyOption {
+    OPT_HITLIST = 256,
+    OPT_ORDERED,
+    OPT_ENCODING,
+    OPT_QUALITY_MASK,
+    OPT_RESULTS,
+    OPT_TAXONOMY,
+    OPT_REQUEST_COMPRESSION,
+    OPT_UNIX_SOCKET,
+    OPT_SHARED_MEMORY,
+    OPT_CONFIDENCE,
+    OPT_HIT_GROUPS,
+    OPT_MIN_QUALITY,
+    OPT_REPORT_KMER,
+    OPT_SAMPLE,
+    OPT_PRIORITY,
+    OPT_LATENCY,
+    OPT_LATENCY_READS,
+};
+
 void ParseCommandLine(int argc, char **argv, Options &opts) {
     // Define the long shell arguments
     struct option long_options[] =
@@ -403,6 +764,23 @@ void ParseCommandLine(int argc, char **argv, Options &opts) {
             {"shutdown", no_argument, NULL, 'K'},
             {"help", no_argument, NULL, 'h'},
             {"help", no_argument, NULL, 'H'},
+            {"hitlist", required_argument, NULL, OPT_HITLIST},
+            {"ordered", no_argument, NULL, OPT_ORDERED},
+            {"encoding", required_argument, NULL, OPT_ENCODING},
+            {"quality-mask", required_argument, NULL, OPT_QUALITY_MASK},
+            {"results", required_argument, NULL, OPT_RESULTS},
+            {"taxonomy", required_argument, NULL, OPT_TAXONOMY},
+            {"request-compression", required_argument, NULL, OPT_REQUEST_COMPRESSION},
+            {"unix-socket", required_argument, NULL, OPT_UNIX_SOCKET},
+            {"shared-memory", required_argument, NULL, OPT_SHARED_MEMORY},
+            {"confidence", required_argument, NULL, OPT_CONFIDENCE},
+            {"hit-groups", required_argument, NULL, OPT_HIT_GROUPS},
+            {"min-quality", required_argument, NULL, OPT_MIN_QUALITY},
+            {"report-kmer", required_argument, NULL, OPT_REPORT_KMER},
+            {"sample", required_argument, NULL, OPT_SAMPLE},
+            {"priority", required_argument, NULL, OPT_PRIORITY},
+            {"latency", required_argument, NULL, OPT_LATENCY},
+            {"latency-reads", required_argument, NULL, OPT_LATENCY_READS},
             {NULL, 0, NULL, 0}};
     int opt;
     // Handle the various shell arguments (long mapped to short)
@@ -439,8 +817,146 @@ void ParseCommandLine(int argc, char **argv, Options &opts) {
                 exit(0);
             }
             break;
+        case OPT_HITLIST:
+            if (std::string(optarg) == "text")
+                opts.hitlist_format = Kraken2SequenceRequestMulti::HITLIST_TEXT;
+            else if (std::string(optarg) == "packed")
+                opts.hitlist_format = Kraken2SequenceRequestMulti::HITLIST_PACKED;
+            else if (std::string(optarg) == "none")
+                opts.hitlist_format = Kraken2SequenceRequestMulti::HITLIST_NONE;
+            else
+            {
+                std::cerr << "Hitlist format not valid (text, packed, none)" << std::endl;
+                exit(0);
+            }
+            break;
+        case OPT_ORDERED:
+            opts.ordered = true;
+            break;
+        case OPT_ENCODING:
+            if (std::string(optarg) == "text")
+                opts.packed = false;
+            else if (std::string(optarg) == "packed")
+                opts.packed = true;
+            else
+            {
+                std::cerr << "Encoding not valid (text, packed)" << std::endl;
+                exit(0);
+            }
+            break;
+        case OPT_QUALITY_MASK:
+            opts.quality_mask = atoi(optarg);
+            if (opts.quality_mask < 0)
+            {
+                std::cerr << "Quality mask not valid (>= 0)" << std::endl;
+                exit(0);
+            }
+            break;
+        case OPT_RESULTS:
+            if (std::string(optarg) == "full")
+                opts.result_format = Kraken2SequenceRequestMulti::RESULT_FULL;
+            else if (std::string(optarg) == "packed")
+                opts.result_format = Kraken2SequenceRequestMulti::RESULT_PACKED;
+            else
+            {
+                std::cerr << "Results format not valid (full, packed)" << std::endl;
+                exit(0);
+            }
+            break;
+        case OPT_TAXONOMY:
+            opts.taxonomy_file = optarg;
+            break;
+        case OPT_REQUEST_COMPRESSION:
+            if (std::string(optarg) == "none")
+                opts.request_compression = GRPC_COMPRESS_NONE;
+            else if (std::string(optarg) == "deflate")
+                opts.request_compression = GRPC_COMPRESS_DEFLATE;
+            else if (std::string(optarg) == "gzip")
+                opts.request_compression = GRPC_COMPRESS_GZIP;
+            else
+            {
+                std::cerr << "Request compression not valid (none, deflate, gzip)" << std::endl;
+                exit(0);
+            }
+            break;
+        case OPT_UNIX_SOCKET:
+            opts.unix_socket = optarg;
+            break;
+        case OPT_SHARED_MEMORY:
+            if (atoi(optarg) < 1)
+            {
+                std::cerr << "Shared memory ring size not valid (> 0)" << std::endl;
+                exit(0);
+            }
+            opts.shared_memory_mb = atoi(optarg);
+            break;
+        case OPT_CONFIDENCE:
+            opts.settings.set_confidence_threshold(atof(optarg));
+            if (opts.settings.confidence_threshold() < 0 || opts.settings.confidence_threshold() > 1)
+            {
+                std::cerr << "Confidence threshold not valid (0 - 1)" << std::endl;
+                exit(0);
+            }
+            break;
+        case OPT_HIT_GROUPS:
+            if (atoi(optarg) < 0)
+            {
+                std::cerr << "Minimum hit groups not valid (>= 0)" << std::endl;
+                exit(0);
+            }
+            opts.settings.set_minimum_hit_groups(atoi(optarg));
+            break;
+        case OPT_MIN_QUALITY:
+            if (atoi(optarg) < 0)
+            {
+                std::cerr << "Minimum quality score not valid (>= 0)" << std::endl;
+                exit(0);
+            }
+            opts.settings.set_minimum_quality_score(atoi(optarg));
+            break;
+        case OPT_REPORT_KMER:
+            if (std::string(optarg) == "yes")
+                opts.settings.set_report_kmer_data(true);
+            else if (std::string(optarg) == "no")
+                opts.settings.set_report_kmer_data(false);
+            else
+            {
+                std::cerr << "Report k-mer not valid (yes, no)" << std::endl;
+                exit(0);
+            }
+            break;
+        case OPT_SAMPLE:
+            opts.sample = optarg;
+            break;
+        case OPT_PRIORITY:
+            if (atoi(optarg) < 0)
+            {
+                std::cerr << "Priority not valid (>= 0)" << std::endl;
+                exit(0);
+            }
+            opts.priority = atoi(optarg);
+            break;
+        case OPT_LATENCY:
+            opts.latency_requests = atoi(optarg);
+            if (opts.latency_requests < 1)
+            {
+                std::cerr << "Latency requests not valid (> 0)" << std::endl;
+                exit(0);
+            }
+            break;
+        case OPT_LATENCY_READS:
+            opts.latency_reads = atoi(optarg);
+            if (opts.latency_reads < 1)
+            {
+                std::cerr << "Latency reads not valid (> 0)" << std::endl;
+                exit(0);
+            }
+            break;
         }
     }
+    // packed records carry no qualities, only the mask, if any
+    if (opts.packed && opts.quality_mask == 0 && opts.settings.has_minimum_quality_score())
+        std::cerr << "Warning: --min-quality has no effect with --encoding packed, use --quality-mask" << std::endl;
 }
 
 int main(int argc, char **argv) {
@@ -449,6 +965,9 @@ int main(int argc, char **argv) {
 
     int rtn_code = 0;
     std::string server_address = opts.host + ":" + std::to_string(opts.port);
+    if (!opts.unix_socket.empty()) {
+        server_address = "unix:" + opts.unix_socket;
+    }
 
     std::cerr << "Connecting to server: " << server_address << "." << std::endl;
 
@@ -458,22 +977,37 @@ int main(int argc, char **argv) {
     // default 4MB message size. Just set it to the max
     grpc::ChannelArguments ch_args;
     ch_args.SetMaxReceiveMessageSize(INT_MAX);
+    // responses are decompressed whatever the server chose
+    if (opts.request_compression != GRPC_COMPRESS_NONE) {
+        ch_args.SetCompressionAlgorithm(opts.request_compression);
+    }
     std::shared_ptr<grpc::Channel> ch =
         grpc::CreateCustomChannel(
             server_address,
             grpc::InsecureChannelCredentials(), ch_args);
-    SequenceClient client(ch);
+    SequenceClient client(ch, opts);
 
     if (opts.shutdown) {
         rtn_code = client.ShutdownServer();
     }
+    else if (!opts.taxonomy_file.empty() && opts.sequence.empty()) {
+        rtn_code = client.GetTaxonomy(opts.taxonomy_file);
+    }
     else if (opts.sequence.empty()) {
         rtn_code = client.GetSummary();
     }
     else {
+        if (!opts.taxonomy_file.empty()) {
+            rtn_code = client.GetTaxonomy(opts.taxonomy_file);
+        }
         const std::string filename(opts.sequence);
         const std::string report_file(opts.report_file);
-        rtn_code = client.ClassifySequences(filename, report_file);
+        if (rtn_code == 0 && opts.latency_requests > 0) {
+            rtn_code = client.MeasureLatency(filename, opts.latency_requests, opts.latency_reads);
+        }
+        else if (rtn_code == 0) {
+            rtn_code = client.ClassifySequences(filename, report_file);
+        }
     }
 
     std::cerr << "Return code: " << rtn_code << std::endl;
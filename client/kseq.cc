@@ -1,11 +1,14 @@
 #include <string>
 
 #include "kseq.cc.h"
+#include "packed_sequence.h"
 
 
-FastReader::FastReader(std::string filename)
+FastReader::FastReader(std::string filename, bool packed, int quality_mask)
 {
     m_filename = filename;
+    m_packed = packed;
+    m_quality_mask = quality_mask;
     FILE *instream = NULL;
     instream = (filename == "-") ? stdin : fopen(filename.c_str(), "r");
     gzFile m_fp = gzdopen(fileno(instream), "r");
@@ -26,6 +29,15 @@ int FastReader::read(Kraken2SequenceRequest& rec) {
         rec.Clear();
         return rtn;
     }
+    else if (m_packed) {
+        // only what the server classifies, no header or text record
+        rec.set_id(m_seq->name.s);
+        rec.set_format(Kraken2SequenceRequest::FORMAT_FASTA);
+        PackSequence(m_seq->seq.s, m_seq->seq.l, *rec.mutable_packed());
+        if (m_quality_mask > 0 && m_seq->qual.l == m_seq->seq.l) {
+            PackQualityMask(m_seq->qual.s, m_seq->qual.l, m_quality_mask, *rec.mutable_packed());
+        }
+    }
     else {
         std::string header;
         m_seq->qual.l == 0 ? header.append(">") : header.append("@");
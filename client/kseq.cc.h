@@ -12,7 +12,9 @@ KSEQ_INIT(gzFile, gzread)
 class FastReader
 {
 public:
-    FastReader(std::string filename);
+    // packed: send sequences 2 bits per base, with a mask of bases below
+    // quality_mask in place of qualities if it is above 0
+    FastReader(std::string filename, bool packed = false, int quality_mask = 0);
     ~FastReader();
     // Read (at most) one sequence
     int read(Kraken2SequenceRequest&);
@@ -24,4 +26,6 @@ private:
     std::string m_filename;
     gzFile m_fp;
     kseq_t *m_seq;
+    bool m_packed;
+    int m_quality_mask;
 };
\ No newline at end of file
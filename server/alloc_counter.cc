@@ -0,0 +1,31 @@
+#include <cstdlib>
+#include <new>
+
+#include "alloc_counter.h"
+
+#ifdef KRAKEN2_COUNT_ALLOCATIONS
+
+static thread_local uint64_t thread_allocations = 0;
+
+// Replacing the scalar forms is enough, the array forms forward to these.
+void *operator new(std::size_t size)
+{
+    thread_allocations++;
+    if (size == 0)
+        size = 1;
+    if (void *ptr = std::malloc(size))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+uint64_t ThreadAllocationCount() { return thread_allocations; }
+
+#else
+
+uint64_t ThreadAllocationCount() { return 0; }
+
+#endif
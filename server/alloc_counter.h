@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstdint>
+
+// Number of heap allocations made so far by the calling thread. Only counted
+// when built with -DCOUNT_ALLOCATIONS=ON, otherwise always 0.
+uint64_t ThreadAllocationCount();
@@ -2,12 +2,23 @@
 #include <getopt.h>
 #include <thread>
 #include <sysexits.h>
+#include <time.h>
 
 #include "classify_server.h"
-#include "messages.h"
 
 using namespace std::chrono_literals; // ns, us, ms, s, h, etc.
 
+// CPU time used so far by the calling thread
+static uint64_t ThreadCpuMicroseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+// Recycled messages holding more than this are freed instead, so a burst of
+// long reads does not keep its batches allocated for the life of the server
+static const size_t MAX_SPARE_BYTES = 4 << 20;
+
 Kraken2ServerClassifier::Kraken2ServerClassifier(Options &options)
         : opts(options),
             taxonomy(opts.taxonomy_filename, opts.use_memory_mapping),
@@ -18,6 +29,10 @@ Kraken2ServerClassifier::Kraken2ServerClassifier(Options &options)
     std::cout << "Creating classification thread pool with "
               << opts.thread_pool << " thread(s)." << std::endl;
     pool.reset(opts.thread_pool);
+    // Never current, the first GetSummary renders the zero totals
+    auto unrendered = std::make_shared<SummarySnapshot>();
+    unrendered->version = UINT64_MAX;
+    std::atomic_store(&summary_snapshot, std::shared_ptr<const SummarySnapshot>(unrendered));
     std::thread loader([this]() { LoadIndex(); });
     loader.detach();
 }
@@ -28,7 +43,71 @@ Kraken2ServerClassifier::~Kraken2ServerClassifier(){
 }
 
 
-const char *Kraken2ServerClassifier::GetSummary() { return summary.c_str(); }
+std::shared_ptr<const SummarySnapshot> Kraken2ServerClassifier::GetSummary() {
+    std::shared_ptr<const SummarySnapshot> snapshot = std::atomic_load(&summary_snapshot);
+    if (snapshot->version == stats_version.load(std::memory_order_acquire)) {
+        return snapshot;
+    }
+    // One caller renders, the others take the last published summary rather
+    // than wait for it
+    std::unique_lock<std::mutex> lock(stats_mtx, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return snapshot;
+    }
+    // Merges finishing after the version is read are folded in now or on
+    // the next call, either way they are not missed
+    uint64_t version = stats_version.load(std::memory_order_acquire);
+    snapshot = std::atomic_load(&summary_snapshot);
+    if (snapshot->version == version) {
+        return snapshot;
+    }
+    FoldStatsShards();
+    auto rendered = std::make_shared<SummarySnapshot>();
+    rendered->version = version;
+    rendered->summary = RenderSummary();
+    snapshot = std::move(rendered);
+    std::atomic_store(&summary_snapshot, snapshot);
+    return snapshot;
+}
+
+
+void Kraken2ServerClassifier::AddToHistory(
+        ClassificationStats &stats, taxon_counters_map_t &taxon_counters) {
+    if (!opts.stats) {
+        return;
+    }
+    // Calls finishing together usually run on different threads, and so
+    // merge into different shards
+    size_t shard_index = std::hash<std::thread::id>()(std::this_thread::get_id()) % stats_shards.size();
+    StatsShard &shard = stats_shards[shard_index];
+    {
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        shard.stats.Merge(stats);
+        for (auto &kv_pair : taxon_counters) {
+            shard.taxon_counters[kv_pair.first] += std::move(kv_pair.second);
+        }
+    }
+    stats_version.fetch_add(1, std::memory_order_release);
+}
+
+
+// Caller holds stats_mtx
+void Kraken2ServerClassifier::FoldStatsShards() {
+    for (StatsShard &shard : stats_shards) {
+        taxon_counters_map_t taxon_counters;
+        ClassificationStats stats;
+        {
+            // swapped out so the shard is only locked briefly
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            std::swap(taxon_counters, shard.taxon_counters);
+            std::swap(stats, shard.stats);
+        }
+        total_stats.Merge(stats);
+        for (auto &kv_pair : taxon_counters) {
+            total_taxon_counters[kv_pair.first] += std::move(kv_pair.second);
+        }
+    }
+}
 
 
 void Kraken2ServerClassifier::LoadIndex() {
@@ -45,6 +124,7 @@ void Kraken2ServerClassifier::LoadIndex() {
         auto opts_filesize = sb.st_size;
         idx_opt_fs.read((char *)&idx_opts, opts_filesize);
         opts.use_translated_search = !idx_opts.dna_db;
+        taxonomy_index.Build(taxonomy);
     }
     catch (const std::exception &ex) {
         std::cerr << "Unable to load index"
@@ -56,42 +136,141 @@ void Kraken2ServerClassifier::LoadIndex() {
     index_available = true;
 }
 
-void ResultsHandler(
-        ServerStream *stream, std::future<void> finish,
-        taxon_counters_t &stream_taxon_counters,
-        ClassificationStats &stream_stats,
-        ThreadSafeQueue<BatchResults> *results_queue) {
-    while (finish.wait_for(0s) == std::future_status::timeout) {
-        std::optional<BatchResults> res = results_queue->pop();
-        if (res.has_value()) {
-            // put the results in the stream
-            // We're assuming the client can receive arbitrarily large messages.
-            // That's fine for now as the client is set to recieve INT_MAX. We could
-            // instead send reads back one by one if the message is large. (Requires
-            // some rejigging of struct in results queue first).
-            Kraken2SequenceStreamResult result;
-            *(result.mutable_classifications()) = res->k2results;
-            stream->Write(result, WriteOptions().set_buffer_hint()); 
-            // update stats for the stream
-            stream_stats.total_bases += res->stats.total_bases;
-            stream_stats.total_classified += res->stats.total_classified;
-            stream_stats.total_sequences += res->stats.total_sequences;
-            // update taxon_counters for the stream
-            for (auto &kv_pair : res->taxon_counters) {
-                stream_taxon_counters[kv_pair.first] += std::move(kv_pair.second);
+ClassificationContext &Kraken2ServerClassifier::WorkerContext() {
+    // One context per pool worker, created on the first batch the worker sees
+    thread_local ClassificationContext context;
+    if (!context.scanner) {
+        context.scanner = std::make_unique<MinimizerScanner>(
+            idx_opts.k, idx_opts.l, idx_opts.spaced_seed_mask,
+            idx_opts.dna_db, idx_opts.toggle_mask,
+            idx_opts.revcom_version);
+        if (opts.minimizer_cache > 0) {
+            size_t slots = 2;
+            context.cache_shift = 63;
+            while (slots < (size_t)opts.minimizer_cache) {
+                slots <<= 1;
+                context.cache_shift--;
             }
+            context.cache.assign(slots, {UINT64_MAX, 0});
         }
     }
+    return context;
+}
+
+
+BatchResults Kraken2ServerClassifier::SpareResults() {
+    std::optional<BatchResults> spare = spare_results.try_pop();
+    if (spare.has_value()) {
+        return std::move(*spare);
+    }
+    return BatchResults();
+}
+
+
+void Kraken2ServerClassifier::RecycleResults(BatchResults &&results) {
+    // Cleared protobuf messages keep their allocated sub-messages and strings,
+    // so the next batch built from these results fills them in place. Keep
+    // only as many as can be in use at once, and only those of typical size.
+    if (spare_results.size() >= 2 * pool.get_thread_count()
+            || results.k2results.SpaceUsedLong() > MAX_SPARE_BYTES) {
+        return;
+    }
+    results.k2results.Clear();
+    results.taxon_counters.clear();
+    results.stats = ClassificationStats();
+    results.sample.clear();
+    results.dropped = false;
+    spare_results.push(std::move(results));
+}
+
+
+std::shared_ptr<Kraken2SequenceRequestMulti> Kraken2ServerClassifier::SpareRequest() {
+    std::optional<std::unique_ptr<Kraken2SequenceRequestMulti>> spare = spare_requests.try_pop();
+    Kraken2SequenceRequestMulti *req = spare.has_value() ? spare->release() : new Kraken2SequenceRequestMulti();
+    // Parsing into a cleared message fills its sub-messages and strings in
+    // place, a steady stream of batches reads without allocating
+    return std::shared_ptr<Kraken2SequenceRequestMulti>(
+        req, [this](Kraken2SequenceRequestMulti *req) {
+            std::unique_ptr<Kraken2SequenceRequestMulti> owned(req);
+            if (spare_requests.size() >= 2 * pool.get_thread_count()
+                    || owned->SpaceUsedLong() > MAX_SPARE_BYTES) {
+                return;
+            }
+            owned->Clear();
+            spare_requests.push(std::move(owned));
+        });
+}
+
+
+void Kraken2ServerClassifier::ResultsHandler(
+        SequenceStream *stream,
+        taxon_counters_map_t &stream_taxon_counters,
+        ClassificationStats &stream_stats, sample_tallies_t &samples,
+        ThreadSafeQueue<BatchResults> *results_queue, StreamBacklog &backlog,
+        StreamCancellation &cancellation) {
+    // The results are swapped into the message rather than copied, and
+    // swapped back once written so their storage is recycled.
+    Kraken2SequenceStreamResult result;
+    auto write = [&](BatchResults &res) {
+        // put the results in the stream
+        // We're assuming the client can receive arbitrarily large messages.
+        // That's fine for now as the client is set to recieve INT_MAX. We could
+        // instead send reads back one by one if the message is large. (Requires
+        // some rejigging of struct in results queue first).
+        bool delivered = false;
+        if (!res.dropped && !cancellation.IsCancelled()) {
+            uint64_t allocations = ThreadAllocationCount();
+            result.mutable_classifications()->Swap(&res.k2results);
+            stream_stats.response_bytes += result.ByteSizeLong();
+            delivered = stream->Write(result, WriteOptions().set_buffer_hint());
+            result.mutable_classifications()->Swap(&res.k2results);
+            stream_stats.io_allocations += ThreadAllocationCount() - allocations;
+            if (!delivered) {
+                // the client has gone, drop what is still queued
+                cancellation.Cancel();
+            }
+        }
+        // update stats and taxon_counters for the stream
+        MergeResults(res, stream_taxon_counters, stream_stats, samples, delivered);
+        RecycleResults(std::move(res));
+    };
+
+    // Sleeps until results arrive, returns once the queue is closed and drained.
+    ReorderBuffer reorder;
+    while (std::optional<BatchResults> res = results_queue->pop()) {
+        bool ordered;
+        {
+            std::lock_guard<std::mutex> lock(backlog.mtx);
+            ordered = backlog.ordered;
+        }
+        if (!ordered) {
+            write(*res);
+            continue;
+        }
+        // release whatever is now in order, the stream waits to read more
+        // while too many batches are held back
+        reorder.Push(std::move(*res));
+        stream_stats.peak_reorder_batches = std::max<uint64_t>(stream_stats.peak_reorder_batches, reorder.size());
+        while (std::optional<BatchResults> next = reorder.Pop()) {
+            write(*next);
+        }
+        {
+            std::lock_guard<std::mutex> lock(backlog.mtx);
+            backlog.released = reorder.released();
+        }
+        backlog.cv.notify_all();
+    }
 }
 
 void Kraken2ServerClassifier::ProcessSequenceStream(
-        ServerContext *context, ServerStream *stream, std::string &results) {
+        ServerContext *context, SequenceStream *stream, std::string &results) {
     std::cerr << "Starting stream handler." << std::endl;
     stream->SendInitialMetadata();
 
-    // Stats for the whole stream
-    taxon_counters_t stream_taxon_counters;
-    ClassificationStats stream_stats = {0, 0, 0};
+    // Stats for the whole stream, and for each sample it carries
+    taxon_counters_map_t stream_taxon_counters;
+    ClassificationStats stream_stats;
+    sample_tallies_t samples;
 
     struct timeval tv1, tv2;
     gettimeofday(&tv1, nullptr);
@@ -99,73 +278,446 @@ void Kraken2ServerClassifier::ProcessSequenceStream(
     // create a queue and associated thread to aggregate the results of batches
     // and post to our output stream
     ThreadSafeQueue<BatchResults> *results_queue = new ThreadSafeQueue<BatchResults>();
-    std::promise<void> complete;
-    std::future<void> batches_complete = complete.get_future();
-    std::thread results_thread(ResultsHandler,
-        stream, std::move(batches_complete),
-        std::ref(stream_taxon_counters), std::ref(stream_stats), results_queue);
-
-    // Classify while reads are still being received on the input stream
-    Kraken2SequenceRequestMulti req;
-    std::vector<Kraken2SequenceRequest> seq_batch;
-    std::vector<std::future<bool>> futures;
-    while (!context->IsCancelled() && stream->Read(&req)) {
-        // We could rebatch here, for now just pass the batch as is.
-        futures.push_back(
-            pool.submit(
-                &Kraken2ServerClassifier::ProcessBatch, this,
-                std::move(req), results_queue));
-    }
-
-    // wait for all futures to resolve, then wait for the queue to be empty,
-    // and finally tell the results thread to finish
-    for (auto &fut : futures) { fut.get(); }
-    while (results_queue->size() > 0) {}
-    complete.set_value();
+    // Shared with the tasks, which may still be releasing them as this
+    // returns once the last has finished
+    auto backlog = std::make_shared<StreamBacklog>();
+    std::shared_ptr<StreamQueue> queue = AddStream();
+    auto cancellation = std::make_shared<StreamCancellation>();
+    cancellation->SetDeadline(context->deadline());
+    std::thread results_thread(&Kraken2ServerClassifier::ResultsHandler, this,
+        stream, std::ref(stream_taxon_counters), std::ref(stream_stats), std::ref(samples),
+        results_queue, std::ref(*backlog), std::ref(*cancellation));
+
+    // Classify while reads are still being received on the input stream.
+    // Each message is read into its own buffer which is handed to the worker
+    // without copying. Reading stops while too many bases are queued, gRPC
+    // flow control then holds back the client.
+    uint64_t request_bytes = 0;
+    uint64_t io_allocations = 0;
+    ClassificationSettings settings = StreamSettings(Kraken2SequenceRequestMulti::default_instance());
+    // stream fields are taken from the first message, even one without reads
+    bool first_read = true;
+    while (!context->IsCancelled()) {
+        {
+            std::unique_lock<std::mutex> lock(backlog->mtx);
+            auto has_room = [&] {
+                uint64_t unreleased = backlog->ordered ? backlog->next_index - backlog->released : 0;
+                return StreamHasRoom(backlog->queued_bases, unreleased);
+            };
+            if (!has_room()) {
+                backlog->read_pauses++;
+                backlog->cv.wait(lock, has_room);
+            }
+        }
+        if (!QueueHasRoom()) {
+            std::lock_guard<std::mutex> lock(backlog->mtx);
+            backlog->read_pauses++;
+        }
+        WaitForQueueRoom();
+
+        uint64_t allocations = ThreadAllocationCount();
+        std::shared_ptr<Kraken2SequenceRequestMulti> req = SpareRequest();
+        if (!stream->Read(req.get())) {
+            break;
+        }
+        request_bytes += req->ByteSizeLong();
+        if (first_read) {
+            first_read = false;
+            settings = StreamSettings(*req);
+            SetStreamPriority(*queue, *req);
+            std::lock_guard<std::mutex> lock(backlog->mtx);
+            backlog->ordered = req->ordered();
+        }
+        for (auto &range : SplitBatch(*req)) {
+            {
+                std::lock_guard<std::mutex> lock(backlog->mtx);
+                range.index = backlog->next_index++;
+                backlog->tasks++;
+                backlog->queued_bases += range.bases;
+                backlog->peak_queued_bases = std::max(backlog->peak_queued_bases, backlog->queued_bases);
+            }
+            QueueBases(range.bases);
+            ScheduleTask(queue,
+                [this, req, range, settings, results_queue, backlog, cancellation] {
+                    ProcessBatch(req, range, settings, *cancellation, results_queue);
+                    DequeueBases(range.bases);
+                    {
+                        std::lock_guard<std::mutex> lock(backlog->mtx);
+                        backlog->tasks--;
+                        backlog->queued_bases -= range.bases;
+                    }
+                    backlog->cv.notify_all();
+                });
+        }
+        io_allocations += ThreadAllocationCount() - allocations;
+    }
+
+    // batches still queued for a client that has gone are dropped rather
+    // than classified
+    if (context->IsCancelled()) {
+        cancellation->Cancel();
+    }
+
+    // wait for all tasks to finish, then close the queue so the results
+    // thread exits once it has written everything out
+    {
+        std::unique_lock<std::mutex> lock(backlog->mtx);
+        backlog->cv.wait(lock, [&] { return backlog->tasks == 0; });
+    }
+    results_queue->close();
     results_thread.join();
+    stream_stats.peak_queued_bases = backlog->peak_queued_bases;
+    stream_stats.read_pauses = backlog->read_pauses;
+    stream_stats.request_bytes = request_bytes;
+    stream_stats.io_allocations += io_allocations;
+    AddQueueWaits(*queue, stream_stats);
 
     gettimeofday(&tv2, nullptr);
-    // generate the report, and update servers total history
-    GenerateReport(
-        results, summary, opts, taxonomy, tv1, tv2, stream_stats, total_stats,
-        stream_taxon_counters, total_taxon_counters, stats_mtx);
+    std::vector<Kraken2SequenceStreamResult> sample_summaries;
+    FinishStream(
+        tv1, tv2, settings, stream_stats, stream_taxon_counters, samples, results,
+        sample_summaries);
+    // the caller follows these with the summary of the whole stream
+    for (auto &summary : sample_summaries) {
+        if (context->IsCancelled()) {
+            break;
+        }
+        stream->Write(summary, WriteOptions());
+    }
 
     delete results_queue;
     std::cerr << "Finished stream handler." << std::endl;
 }
 
 
+std::vector<BatchRange> Kraken2ServerClassifier::SplitBatch(
+    const Kraken2SequenceRequestMulti &reqs) {
+    // Client batches are a fixed number of reads, so their size in bases
+    // varies by orders of magnitude. Split large ones into tasks of roughly
+    // equal base count, all sharing the one request.
+    int n_seqs = reqs.seqs_size();
+    uint64_t total_bases = 0;
+    for (auto &req : reqs.seqs()) {
+        total_bases += SequenceLength(req);
+    }
+    uint64_t n_tasks = 1;
+    if (opts.batch_bases > 0) {
+        n_tasks = std::max<uint64_t>(1, total_bases / opts.batch_bases);
+    }
+    uint64_t task_bases = (total_bases + n_tasks - 1) / n_tasks;
+
+    std::vector<BatchRange> ranges;
+    // reads without bases cost little to classify, keep them together
+    if (total_bases == 0) {
+        if (n_seqs > 0) {
+            ranges.push_back({0, n_seqs, 0});
+        }
+        return ranges;
+    }
+    int first = 0;
+    uint64_t bases = 0;
+    for (int i = 0; i < n_seqs; ++i) {
+        bases += SequenceLength(reqs.seqs(i));
+        if (bases >= task_bases || i == n_seqs - 1) {
+            ranges.push_back({first, i + 1, bases});
+            first = i + 1;
+            bases = 0;
+        }
+    }
+    return ranges;
+}
+
+
+void Kraken2ServerClassifier::PushTask(std::function<void()> task) {
+    pool.push_task(std::move(task));
+}
+
+
+std::shared_ptr<StreamQueue> Kraken2ServerClassifier::AddStream() {
+    return scheduler.AddStream();
+}
+
+
+void Kraken2ServerClassifier::SetStreamPriority(
+        StreamQueue &queue, const Kraken2SequenceRequestMulti &reqs) {
+    uint32_t max_priority = std::max(opts.max_priority, 0);
+    scheduler.SetPriority(queue, std::min(reqs.priority(), max_priority));
+}
+
+
+void Kraken2ServerClassifier::ScheduleTask(
+        const std::shared_ptr<StreamQueue> &queue, std::function<void()> task) {
+    // The pool stays first come first served, each of its tasks runs
+    // whichever stream's task is next in turn at the time
+    scheduler.Push(queue, std::move(task));
+    pool.push_task([this] { scheduler.RunNext(); });
+}
+
+
+void Kraken2ServerClassifier::AddQueueWaits(const StreamQueue &queue, ClassificationStats &stats) {
+    QueueWaits waits = scheduler.Waits(queue);
+    stats.scheduled_tasks += waits.tasks;
+    stats.queue_wait_us += waits.total_us;
+    stats.peak_queue_wait_us = std::max(stats.peak_queue_wait_us, waits.peak_us);
+}
+
+
+void Kraken2ServerClassifier::QueueBases(uint64_t bases) {
+    std::lock_guard<std::mutex> lock(queued_mtx);
+    queued_bases += bases;
+    peak_queued_bases = std::max(peak_queued_bases, queued_bases);
+}
+
+
+void Kraken2ServerClassifier::DequeueBases(uint64_t bases) {
+    std::vector<std::function<void()>> resume;
+    {
+        std::lock_guard<std::mutex> lock(queued_mtx);
+        queued_bases -= bases;
+        if (opts.max_queued_bases == 0 || queued_bases < opts.max_queued_bases) {
+            resume.swap(queue_waiters);
+        }
+    }
+    queued_cv.notify_all();
+    // outside the lock, waiters take their stream's lock and may check again
+    for (auto &f : resume) { f(); }
+}
+
+
+bool Kraken2ServerClassifier::QueueHasRoom(std::function<void()> resume) {
+    std::lock_guard<std::mutex> lock(queued_mtx);
+    if (opts.max_queued_bases == 0 || queued_bases < opts.max_queued_bases) {
+        return true;
+    }
+    if (resume) {
+        queue_waiters.push_back(std::move(resume));
+    }
+    return false;
+}
+
+
+void Kraken2ServerClassifier::WaitForQueueRoom() {
+    std::unique_lock<std::mutex> lock(queued_mtx);
+    queued_cv.wait(lock, [this] {
+        return opts.max_queued_bases == 0 || queued_bases < opts.max_queued_bases;
+    });
+}
+
+
+bool Kraken2ServerClassifier::StreamHasRoom(uint64_t stream_queued_bases, uint64_t unreleased_batches) {
+    return (opts.stream_queued_bases == 0 || stream_queued_bases < opts.stream_queued_bases)
+        && (opts.reorder_window <= 0 || unreleased_batches < (uint64_t)opts.reorder_window);
+}
+
+
+void Kraken2ServerClassifier::MergeResults(
+        BatchResults &res, taxon_counters_map_t &stream_taxon_counters,
+        ClassificationStats &stream_stats, sample_tallies_t &samples, bool delivered) {
+    if (res.dropped || !delivered) {
+        res.stats.wasted_cpu_us += res.stats.cpu_us;
+    }
+    if (res.dropped) {
+        // what was classified before the stream was cancelled is not counted
+        stream_stats.dropped_batches++;
+        stream_stats.cpu_us += res.stats.cpu_us;
+        stream_stats.wasted_cpu_us += res.stats.wasted_cpu_us;
+        return;
+    }
+    stream_stats.Merge(res.stats);
+    // A sample's counters reach the stream's only once it is reported, so
+    // each batch is merged once
+    taxon_counters_map_t *counters = &stream_taxon_counters;
+    if (!res.sample.empty()) {
+        SampleTally &tally = samples[res.sample];
+        tally.stats.Merge(res.stats);
+        counters = &tally.taxon_counters;
+    }
+    for (auto &kv_pair : res.taxon_counters) {
+        (*counters)[kv_pair.first] += std::move(kv_pair.second);
+    }
+}
+
+
+void Kraken2ServerClassifier::FinishStream(
+        timeval &tv1, timeval &tv2, const ClassificationSettings &settings,
+        ClassificationStats &stream_stats, taxon_counters_map_t &stream_taxon_counters,
+        sample_tallies_t &samples, std::string &results,
+        std::vector<Kraken2SequenceStreamResult> &sample_summaries) {
+    for (auto &kv_pair : samples) {
+        sample_summaries.emplace_back();
+        sample_summaries.back().set_sample(kv_pair.first);
+        sample_summaries.back().set_summary(ReportSample(kv_pair.first, kv_pair.second, settings));
+        for (auto &counter : kv_pair.second.taxon_counters) {
+            stream_taxon_counters[counter.first] += std::move(counter.second);
+        }
+    }
+    // generate the report, and update servers total history
+    GenerateReport(
+        results, opts, settings, taxonomy, tv1, tv2, stream_stats, stream_taxon_counters);
+}
+
+
+void Kraken2ServerClassifier::ClassifyRequest(
+        ServerContext *context, const Kraken2ClassifyRequest &req, Kraken2ClassifyResult &result) {
+    // Copied into a recycled message as quality masking works in place, for
+    // a few reads that costs less than the allocations it avoids
+    std::shared_ptr<Kraken2SequenceRequestMulti> reqs = SpareRequest();
+    reqs->CopyFrom(req.sequences());
+    reqs->clear_sample();
+    ClassificationSettings settings = StreamSettings(*reqs);
+
+    // No results thread, the caller waits for the tasks and collects their
+    // results in order
+    std::vector<BatchRange> ranges = SplitBatch(*reqs);
+    ThreadSafeQueue<BatchResults> results_queue;
+    std::shared_ptr<StreamQueue> queue = AddStream();
+    SetStreamPriority(*queue, *reqs);
+    StreamCancellation cancellation;
+    cancellation.SetDeadline(context->deadline());
+    std::vector<std::future<void>> tasks;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        ranges[i].index = i;
+        WaitForQueueRoom();
+        QueueBases(ranges[i].bases);
+        auto task = std::make_shared<std::packaged_task<void()>>(
+            [this, reqs, range = ranges[i], settings, &cancellation, &results_queue] {
+                ProcessBatch(reqs, range, settings, cancellation, &results_queue);
+                DequeueBases(range.bases);
+            });
+        tasks.push_back(task->get_future());
+        ScheduleTask(queue, [task] { (*task)(); });
+    }
+    for (auto &task : tasks) {
+        // a client giving up on the call leaves the rest of it unclassified
+        while (task.wait_for(10ms) == std::future_status::timeout) {
+            if (context->IsCancelled()) {
+                cancellation.Cancel();
+            }
+        }
+    }
+    bool delivered = !cancellation.IsCancelled();
+
+    taxon_counters_map_t taxon_counters;
+    ClassificationStats stats;
+    sample_tallies_t samples;
+    AddQueueWaits(*queue, stats);
+    ReorderBuffer reorder;
+    while (std::optional<BatchResults> res = results_queue.try_pop()) {
+        reorder.Push(std::move(*res));
+    }
+    while (std::optional<BatchResults> res = reorder.Pop()) {
+        if (delivered && ranges.size() == 1) {
+            result.mutable_classifications()->Swap(&res->k2results);
+        }
+        else if (delivered) {
+            result.mutable_classifications()->MergeFrom(res->k2results);
+        }
+        MergeResults(*res, taxon_counters, stats, samples, delivered);
+        RecycleResults(std::move(*res));
+    }
+
+    if (req.report() && delivered) {
+        std::ostringstream ss;
+        ReportKrakenStyle(ss,
+                          opts.report_zero_counts,
+                          settings.report_kmer_data,
+                          taxonomy,
+                          taxon_counters,
+                          stats.total_sequences,
+                          stats.total_sequences - stats.total_classified);
+        result.set_report(ss.str());
+    }
+
+    AddToHistory(stats, taxon_counters);
+}
+
+
+void Kraken2ServerClassifier::WriteTaxonomy(
+        ServerContext *context, ServerWriter<Kraken2TaxonomyTable> *writer) {
+    // Node 0 is kraken2's null node, so the root's parent has ID 0
+    const size_t TABLE_SIZE = 10000;
+    const TaxonomyNode *nodes = taxonomy.nodes();
+    Kraken2TaxonomyTable table;
+    for (size_t i = 1; i < taxonomy.node_count() && !context->IsCancelled(); ++i) {
+        const TaxonomyNode &node = nodes[i];
+        table.add_tax_ids(node.external_id);
+        table.add_parent_ids(nodes[node.parent_id].external_id);
+        table.add_names(taxonomy.name_data() + node.name_offset);
+        table.add_ranks(taxonomy.rank_data() + node.rank_offset);
+        if ((size_t)table.tax_ids_size() == TABLE_SIZE || i + 1 == taxonomy.node_count()) {
+            writer->Write(table);
+            table.Clear();
+        }
+    }
+}
+
+
+ClassificationSettings Kraken2ServerClassifier::StreamSettings(const Kraken2SequenceRequestMulti &reqs) {
+    ClassificationSettings settings;
+    settings.confidence_threshold = opts.confidence_threshold;
+    settings.minimum_quality_score = opts.minimum_quality_score;
+    settings.minimum_hit_groups = opts.minimum_hit_groups;
+    settings.report_kmer_data = opts.report_kmer_data;
+    if (!reqs.has_settings()) {
+        return settings;
+    }
+    // out of range values are clamped, a stream has no way to be refused once started
+    const Kraken2ClassificationSettings &asked = reqs.settings();
+    if (asked.has_confidence_threshold())
+        settings.confidence_threshold = std::clamp(asked.confidence_threshold(), 0.0, 1.0);
+    if (asked.has_minimum_quality_score())
+        settings.minimum_quality_score = std::min<uint32_t>(asked.minimum_quality_score(), INT_MAX);
+    if (asked.has_minimum_hit_groups())
+        settings.minimum_hit_groups = std::min<uint32_t>(asked.minimum_hit_groups(), INT_MAX);
+    if (asked.has_report_kmer_data())
+        settings.report_kmer_data = asked.report_kmer_data();
+    return settings;
+}
+
+
 bool Kraken2ServerClassifier::ProcessBatch(
-    Kraken2SequenceRequestMulti reqs,
+    std::shared_ptr<Kraken2SequenceRequestMulti> reqs, const BatchRange &range,
+    const ClassificationSettings &settings, const StreamCancellation &cancellation,
     ThreadSafeQueue<BatchResults> *result_q) {
 
-    MinimizerScanner scanner(
-        idx_opts.k, idx_opts.l, idx_opts.spaced_seed_mask,
-        idx_opts.dna_db, idx_opts.toggle_mask,
-        idx_opts.revcom_version);
-    vector<taxid_t> taxa;
-    taxon_counts_t hit_counts;
-    vector<string> translated_frames(6);
-
-    BatchResults results = BatchResults();
+    uint64_t allocations = ThreadAllocationCount();
+    uint64_t cpu = ThreadCpuMicroseconds();
+    ClassificationContext &context = WorkerContext();
+    BatchResults results = SpareResults();
+    results.index = range.index;
+    results.sample = reqs->sample();
 
-    kraken2::Sequence seq;
-    for (auto &req : reqs.seqs()) {
-        SequenceRequestToSequence(req, seq);
+    // Our range of the batch is ours alone, so quality masking is done in
+    // place on the request and the scanner reads straight from the protobuf
+    // strings. Packed sequences are decoded into the worker's own buffer.
+    for (int i = range.first; i < range.last; ++i) {
+        // Still pushed, so ordered results are released past it
+        if (cancellation.IsCancelled()) {
+            results.dropped = true;
+            break;
+        }
+        Kraken2SequenceRequest &req = *reqs->mutable_seqs(i);
+        std::string *seq = req.mutable_seq();
+        if (req.has_packed()) {
+            UnpackSequence(req.packed(), context.unpacked);
+            seq = &context.unpacked;
+        }
         results.stats.total_sequences++;
-        results.stats.total_bases += seq.seq.size();
-        if (opts.minimum_quality_score > 0)
-            MaskLowQualityBases(seq, opts.minimum_quality_score);
+        results.stats.total_bases += seq->size();
+        if (settings.minimum_quality_score > 0)
+            MaskLowQualityBases(req, *seq, settings.minimum_quality_score);
 
-        Kraken2SequenceResult classification = ClassifySequence(
-            seq, hash, taxonomy, idx_opts, opts, results.stats, scanner,
-            taxa, hit_counts, translated_frames, results.taxon_counters);
-
-        results.k2results.mutable_classes()->Add(std::move(classification));
+        ClassifySequence(
+            req.id(), *seq, hash, taxonomy, idx_opts, opts, settings, results.stats, context,
+            results.taxon_counters, reqs->hitlist_format(), reqs->result_format(),
+            results.k2results);
     }
 
+    results.stats.allocations += ThreadAllocationCount() - allocations;
+    results.stats.cpu_us += ThreadCpuMicroseconds() - cpu;
+    bool dropped = results.dropped;
     result_q->push(std::move(results));
-    return true;
+    return !dropped;
 }
 
 
@@ -174,8 +726,16 @@ bool Kraken2ServerClassifier::ProcessBatch(
 // Paired end and quick mode logic has been removed.
 ////////////////////////////////
 
+// Append an integer without going through iostreams
+static inline void AppendInteger(std::string &out, uint64_t value)
+{
+    char buffer[24];
+    auto res = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    out.append(buffer, res.ptr - buffer);
+}
+
 void Kraken2ServerClassifier::AddHitlistString(
-    ostringstream &oss, vector<taxid_t> &taxa, Taxonomy &taxonomy)
+    std::string &out, vector<taxid_t> &taxa, Taxonomy &taxonomy)
 {
     auto last_code = taxa[0];
     auto code_count = 1;
@@ -194,17 +754,19 @@ void Kraken2ServerClassifier::AddHitlistString(
             {
                 if (last_code == AMBIGUOUS_SPAN_TAXON)
                 {
-                    oss << "A:" << code_count << " ";
+                    out.append("A:");
                 }
                 else
                 {
-                    auto ext_code = taxonomy.nodes()[last_code].external_id;
-                    oss << ext_code << ":" << code_count << " ";
+                    AppendInteger(out, taxonomy.nodes()[last_code].external_id);
+                    out.push_back(':');
                 }
+                AppendInteger(out, code_count);
+                out.push_back(' ');
             }
             else
             { // mate pair/reading frame marker
-                oss << (last_code == MATE_PAIR_BORDER_TAXON ? "|:| " : "-:- ");
+                out.append(last_code == MATE_PAIR_BORDER_TAXON ? "|:| " : "-:- ");
             }
             code_count = 1;
             last_code = code;
@@ -214,106 +776,259 @@ void Kraken2ServerClassifier::AddHitlistString(
     {
         if (last_code == AMBIGUOUS_SPAN_TAXON)
         {
-            oss << "A:" << code_count << " ";
+            out.append("A:");
+            AppendInteger(out, code_count);
+            out.push_back(' ');
         }
         else
         {
-            auto ext_code = taxonomy.nodes()[last_code].external_id;
-            oss << ext_code << ":" << code_count;
+            AppendInteger(out, taxonomy.nodes()[last_code].external_id);
+            out.push_back(':');
+            AppendInteger(out, code_count);
         }
     }
     else
     { // mate pair/reading frame marker
-        oss << (last_code == MATE_PAIR_BORDER_TAXON ? "|:|" : "-:-");
+        out.append(last_code == MATE_PAIR_BORDER_TAXON ? "|:|" : "-:-");
     }
 }
 
-Kraken2SequenceResult Kraken2ServerClassifier::ClassifySequence(
-    Sequence &dna, CompactHashTable &hash, Taxonomy &taxonomy, IndexOptions &idx_opts,
-    Options &opts, ClassificationStats &stats, MinimizerScanner &scanner,
-    vector<taxid_t> &taxa, taxon_counts_t &hit_counts,
-    vector<string> &tx_frames, taxon_counters_t &curr_taxon_counts)
+void Kraken2ServerClassifier::AddPackedHitlist(
+    Kraken2Hitlist &out, vector<taxid_t> &taxa, Taxonomy &taxonomy)
 {
-    uint64_t *minimizer_ptr;
-    taxid_t call = 0;
-    taxa.clear();
-    hit_counts.clear();
-    auto frame_ct = opts.use_translated_search ? 6 : 1;
-    int64_t minimizer_hit_groups = 0;
+    // Codes as documented on Kraken2Hitlist, the server never produces
+    // mate pair borders.
+    auto add_run = [&](taxid_t taxon, uint32_t count) {
+        uint64_t code;
+        if (taxon == AMBIGUOUS_SPAN_TAXON)
+            code = 0;
+        else if (taxon == READING_FRAME_BORDER_TAXON)
+            code = 1;
+        else
+            code = taxonomy.nodes()[taxon].external_id + 2;
+        out.add_codes(code);
+        out.add_counts(count);
+    };
 
-    if (opts.use_translated_search)
-    {
-        TranslateToAllFrames(dna.seq, tx_frames);
-    }
-    // index of frame is 0 - 5 w/ tx search (or 0 if no tx search)
-    for (int frame_idx = 0; frame_idx < frame_ct; frame_idx++)
+    auto last_code = taxa[0];
+    uint32_t code_count = 1;
+    for (size_t i = 1; i < taxa.size(); i++)
     {
-        if (opts.use_translated_search)
+        if (taxa[i] == last_code)
         {
-            scanner.LoadSequence(tx_frames[frame_idx]);
+            code_count += 1;
         }
         else
         {
-            scanner.LoadSequence(dna.seq);
+            add_run(last_code, code_count);
+            code_count = 1;
+            last_code = taxa[i];
         }
-        uint64_t last_minimizer = UINT64_MAX;
-        taxid_t last_taxon = TAXID_MAX;
-        while ((minimizer_ptr = scanner.NextMinimizer()) != nullptr)
+    }
+    add_run(last_code, code_count);
+}
+
+taxid_t Kraken2ServerClassifier::LookupMinimizer(
+    ClassificationContext &context, uint64_t minimizer, ClassificationStats &stats)
+{
+    if (context.cache.empty())
+        return hash.Get(minimizer);
+    auto &entry = context.cache[(minimizer * 0x9E3779B97F4A7C15ULL) >> context.cache_shift];
+    if (entry.minimizer == minimizer)
+    {
+        stats.cache_hits++;
+        return entry.taxon;
+    }
+    taxid_t taxon = hash.Get(minimizer);
+    entry = {minimizer, taxon};
+    stats.cache_misses++;
+    return taxon;
+}
+
+void Kraken2ServerClassifier::ScanMinimizers(
+    ClassificationContext &context, const std::string &seq, size_t start, size_t finish,
+    ScanResult &scan, ClassificationStats &stats)
+{
+    MinimizerScanner &scanner = *context.scanner;
+    uint64_t *minimizer_ptr;
+
+    scanner.LoadSequence(seq, start, finish);
+    uint64_t last_minimizer = UINT64_MAX;
+    taxid_t last_taxon = TAXID_MAX;
+    while ((minimizer_ptr = scanner.NextMinimizer()) != nullptr)
+    {
+        taxid_t taxon;
+        if (scanner.is_ambiguous())
         {
-            taxid_t taxon;
-            if (scanner.is_ambiguous())
-            {
-                taxon = AMBIGUOUS_SPAN_TAXON;
-            }
-            else
+            taxon = AMBIGUOUS_SPAN_TAXON;
+        }
+        else
+        {
+            if (*minimizer_ptr != last_minimizer)
             {
-                if (*minimizer_ptr != last_minimizer)
+                bool skip_lookup = false;
+                if (idx_opts.minimum_acceptable_hash_value)
                 {
-                    bool skip_lookup = false;
-                    if (idx_opts.minimum_acceptable_hash_value)
-                    {
-                        if (MurmurHash3(*minimizer_ptr) < idx_opts.minimum_acceptable_hash_value)
-                            skip_lookup = true;
-                    }
-                    taxon = 0;
-                    if (!skip_lookup)
-                        taxon = hash.Get(*minimizer_ptr);
-                    last_taxon = taxon;
-                    last_minimizer = *minimizer_ptr;
-                    // Increment this only if (a) we have DB hit and
-                    // (b) minimizer != last minimizer
-
-                    if (taxon)
-                    {
-                        minimizer_hit_groups++;
-                        // New minimizer should trigger registering minimizer in RC/HLL
-                        curr_taxon_counts[taxon].add_kmer(scanner.last_minimizer());
-                    }
+                    if (MurmurHash3(*minimizer_ptr) < idx_opts.minimum_acceptable_hash_value)
+                        skip_lookup = true;
                 }
-                else
+                taxon = 0;
+                if (!skip_lookup)
+                    taxon = LookupMinimizer(context, *minimizer_ptr, stats);
+                last_taxon = taxon;
+                last_minimizer = *minimizer_ptr;
+                if (!scan.has_first_minimizer)
                 {
-                    taxon = last_taxon;
+                    scan.has_first_minimizer = true;
+                    scan.first_minimizer = *minimizer_ptr;
+                    scan.first_taxon = taxon;
                 }
+                // Increment this only if (a) we have DB hit and
+                // (b) minimizer != last minimizer
                 if (taxon)
                 {
-                    hit_counts[taxon]++;
+                    // New minimizer should trigger registering minimizer in RC/HLL
+                    scan.hit_groups.emplace_back(taxon, scanner.last_minimizer());
                 }
             }
-            taxa.push_back(taxon);
+            else
+            {
+                taxon = last_taxon;
+            }
+            if (taxon)
+            {
+                scan.hit_counts[taxon]++;
+            }
         }
-        if (opts.use_translated_search && frame_idx != 5)
-            taxa.push_back(READING_FRAME_BORDER_TAXON);
+        scan.taxa.push_back(taxon);
+    }
+    scan.last_minimizer = last_minimizer;
+}
+
+void Kraken2ServerClassifier::ScanChunks(std::shared_ptr<ChunkedScan> job)
+{
+    size_t n_chunks = job->chunks.size();
+    size_t done = 0;
+    size_t chunk;
+    while ((chunk = job->next_chunk++) < n_chunks)
+    {
+        // k-mers starting in [start, start + chunk_size) belong to this chunk,
+        // the following k - 1 bases complete the last of them.
+        size_t start = chunk * job->chunk_size;
+        size_t finish = std::min(start + job->chunk_size + job->overlap, job->seq->size());
+        ScanMinimizers(WorkerContext(), *job->seq, start, finish,
+                       job->chunks[chunk], job->chunk_stats[chunk]);
+        done++;
+    }
+    if (done)
+    {
+        std::lock_guard<std::mutex> lock(job->mtx);
+        job->chunks_done += done;
+        if (job->chunks_done == n_chunks)
+            job->done_cv.notify_all();
     }
+}
 
-    delete minimizer_ptr;
+void Kraken2ServerClassifier::ScanChunked(
+    ClassificationContext &context, const std::string &seq, ClassificationStats &stats)
+{
+    size_t threads = pool.get_thread_count();
+    auto job = std::make_shared<ChunkedScan>();
+    job->seq = &seq;
+    job->chunk_size = std::max((size_t)opts.chunk_length, (seq.size() + threads - 1) / threads);
+    job->overlap = idx_opts.k - 1;
+    size_t n_chunks = (seq.size() + job->chunk_size - 1) / job->chunk_size;
+    job->chunks.resize(n_chunks);
+    job->chunk_stats.resize(n_chunks);
+
+    // Helpers and this thread claim chunks from the same counter, so all
+    // chunks are done even if no helper starts before this thread finishes
+    // (e.g. every worker is busy with a long read of its own). Late helpers
+    // find nothing to claim and return without touching the sequence.
+    for (size_t i = 1; i < n_chunks; i++)
+        pool.push_task(&Kraken2ServerClassifier::ScanChunks, this, job);
+    ScanChunks(job);
+    {
+        std::unique_lock<std::mutex> lock(job->mtx);
+        job->done_cv.wait(lock, [&job, n_chunks] { return job->chunks_done == n_chunks; });
+    }
+
+    // Stitch the chunks back together. Each chunk started with no previous
+    // minimizer, so its first one opened a hit group even when it repeats
+    // the minimizer that ended the preceding chunks; drop those.
+    ScanResult &scan = context.scan;
+    uint64_t last_minimizer = UINT64_MAX;
+    for (size_t i = 0; i < n_chunks; i++)
+    {
+        ScanResult &chunk = job->chunks[i];
+        scan.taxa.insert(scan.taxa.end(), chunk.taxa.begin(), chunk.taxa.end());
+        for (auto &kv_pair : chunk.hit_counts)
+            scan.hit_counts[kv_pair.first] += kv_pair.second;
+        auto first_group = chunk.hit_groups.begin();
+        if (chunk.has_first_minimizer)
+        {
+            if (chunk.first_minimizer == last_minimizer && chunk.first_taxon)
+                ++first_group;
+            last_minimizer = chunk.last_minimizer;
+        }
+        scan.hit_groups.insert(scan.hit_groups.end(), first_group, chunk.hit_groups.end());
+        stats.cache_hits += job->chunk_stats[i].cache_hits;
+        stats.cache_misses += job->chunk_stats[i].cache_misses;
+    }
+}
+
+void Kraken2ServerClassifier::ClassifySequence(
+    const std::string &id, const std::string &seq, CompactHashTable &hash, Taxonomy &taxonomy, IndexOptions &idx_opts,
+    Options &opts, const ClassificationSettings &settings,
+    ClassificationStats &stats, ClassificationContext &context,
+    taxon_counters_map_t &curr_taxon_counts, HitlistFormat hitlist_format,
+    ResultFormat result_format, Kraken2SequenceResultMulti &results)
+{
+    ScanResult &scan = context.scan;
+    vector<taxid_t> &taxa = scan.taxa;
+    vector<string> &tx_frames = context.translated_frames;
+    taxid_t call = 0;
+    scan.clear();
+    auto frame_ct = opts.use_translated_search ? 6 : 1;
+
+    if (opts.use_translated_search)
+    {
+        TranslateToAllFrames(seq, tx_frames);
+    }
+    if (!opts.use_translated_search && opts.chunk_length > 0
+        && seq.size() > (size_t)opts.chunk_length && pool.get_thread_count() > 1)
+    {
+        ScanChunked(context, seq, stats);
+    }
+    else
+    {
+        // index of frame is 0 - 5 w/ tx search (or 0 if no tx search)
+        for (int frame_idx = 0; frame_idx < frame_ct; frame_idx++)
+        {
+            if (opts.use_translated_search)
+            {
+                ScanMinimizers(context, tx_frames[frame_idx], 0, SIZE_MAX, scan, stats);
+            }
+            else
+            {
+                ScanMinimizers(context, seq, 0, SIZE_MAX, scan, stats);
+            }
+            if (opts.use_translated_search && frame_idx != 5)
+                taxa.push_back(READING_FRAME_BORDER_TAXON);
+        }
+    }
+
+    int64_t minimizer_hit_groups = scan.hit_groups.size();
+    for (auto &group : scan.hit_groups)
+        curr_taxon_counts[group.first].add_kmer(group.second);
 
     auto total_kmers = taxa.size();
 
     if (opts.use_translated_search) // account for reading frame markers
         total_kmers -= 2;
-    call = ResolveTree(hit_counts, taxonomy, total_kmers, opts);
+    call = ResolveTree(context, taxonomy, total_kmers, settings);
     // Void a call made by too few minimizer groups
-    if (call && minimizer_hit_groups < opts.minimum_hit_groups)
+    if (call && minimizer_hit_groups < settings.minimum_hit_groups)
         call = 0;
 
     if (call)
@@ -322,104 +1037,84 @@ Kraken2SequenceResult Kraken2ServerClassifier::ClassifySequence(
         curr_taxon_counts[call].incrementReadCount();
     }
 
-    Kraken2SequenceResult result;
-    result.set_id(dna.id);
-    if (call)
+    // Hitlists go to the field of the requested result and hitlist format
+    std::string *text_hitlist = nullptr;
+    Kraken2Hitlist *packed_hitlist = nullptr;
+    if (result_format == Kraken2SequenceRequestMulti::RESULT_PACKED)
     {
-        result.set_classified(true);
-        result.set_tax_id(taxonomy.nodes()[call].external_id);
-        result.set_name(taxonomy.name_data() + taxonomy.nodes()[call].name_offset);
+        Kraken2PackedResults &packed = *results.mutable_packed();
+        packed.add_ids(id);
+        packed.add_classified(call != 0);
+        packed.add_tax_ids(call ? taxonomy.nodes()[call].external_id : 0);
+        packed.add_sizes(seq.size());
+        if (hitlist_format == Kraken2SequenceRequestMulti::HITLIST_PACKED)
+            packed_hitlist = packed.add_packed_hitlists();
+        else if (hitlist_format == Kraken2SequenceRequestMulti::HITLIST_TEXT)
+            text_hitlist = packed.add_hitlists();
     }
-    else
-        result.set_classified(false);
-    result.set_size(dna.seq.size());
-    if (taxa.empty())
-        result.set_hitlist("0:0");
     else
     {
-        std::ostringstream hitlist;
-        AddHitlistString(hitlist, taxa, taxonomy);
-        result.set_hitlist(hitlist.str());
+        Kraken2SequenceResult &result = *results.add_classes();
+        result.set_id(id);
+        if (call)
+        {
+            result.set_classified(true);
+            result.set_tax_id(taxonomy.nodes()[call].external_id);
+            result.set_name(taxonomy.name_data() + taxonomy.nodes()[call].name_offset);
+        }
+        else
+            result.set_classified(false);
+        result.set_size(seq.size());
+        if (hitlist_format == Kraken2SequenceRequestMulti::HITLIST_PACKED)
+            packed_hitlist = result.mutable_packed_hitlist();
+        else if (hitlist_format == Kraken2SequenceRequestMulti::HITLIST_TEXT)
+            text_hitlist = result.mutable_hitlist();
     }
 
-    return result;
+    if (packed_hitlist)
+    {
+        if (taxa.empty())
+        {
+            packed_hitlist->add_codes(2);
+            packed_hitlist->add_counts(0);
+        }
+        else
+            AddPackedHitlist(*packed_hitlist, taxa, taxonomy);
+    }
+    if (text_hitlist)
+    {
+        // Built in place, a recycled result keeps the string's capacity
+        text_hitlist->clear();
+        if (taxa.empty())
+            text_hitlist->assign("0:0");
+        else
+            AddHitlistString(*text_hitlist, taxa, taxonomy);
+    }
 }
 
-void Kraken2ServerClassifier::MaskLowQualityBases(Sequence &dna, int minimum_quality_score)
+void Kraken2ServerClassifier::MaskLowQualityBases(const Kraken2SequenceRequest &req, std::string &seq, int minimum_quality_score)
 {
-    if (dna.format != FORMAT_FASTQ)
+    if (req.format() != Kraken2SequenceRequest::FORMAT_FASTQ)
         return;
-    if (dna.seq.size() != dna.quals.size())
+    const std::string &quals = req.quals();
+    if (seq.size() != quals.size())
         errx(EX_DATAERR, "%s: Sequence length (%d) != Quality string length (%d)",
-             dna.id.c_str(), (int)dna.seq.size(), (int)dna.quals.size());
-    for (size_t i = 0; i < dna.seq.size(); i++)
+             req.id().c_str(), (int)seq.size(), (int)quals.size());
+    for (size_t i = 0; i < seq.size(); i++)
     {
-        if ((dna.quals[i] - '!') < minimum_quality_score)
-            dna.seq[i] = 'x';
+        if ((quals[i] - '!') < minimum_quality_score)
+            seq[i] = 'x';
     }
 }
 
 
-taxid_t Kraken2ServerClassifier::ResolveTree(taxon_counts_t &hit_counts,
-                                             Taxonomy &taxonomy, size_t total_minimizers, Options &opts)
+taxid_t Kraken2ServerClassifier::ResolveTree(ClassificationContext &context,
+                                             Taxonomy &taxonomy, size_t total_minimizers,
+                                             const ClassificationSettings &settings)
 {
-    taxid_t max_taxon = 0;
-    uint32_t max_score = 0;
-    uint32_t required_score = ceil(opts.confidence_threshold * total_minimizers);
-
-    // Sum each taxon's LTR path, find taxon with highest LTR score
-    for (auto &kv_pair : hit_counts)
-    {
-        taxid_t taxon = kv_pair.first;
-        uint32_t score = 0;
-
-        for (auto &kv_pair2 : hit_counts)
-        {
-            taxid_t taxon2 = kv_pair2.first;
-
-            if (taxonomy.IsAAncestorOfB(taxon2, taxon))
-            {
-                score += kv_pair2.second;
-            }
-        }
-
-        if (score > max_score)
-        {
-            max_score = score;
-            max_taxon = taxon;
-        }
-        else if (score == max_score)
-        {
-            max_taxon = taxonomy.LowestCommonAncestor(max_taxon, taxon);
-        }
-    }
-
-    // Reset max. score to be only hits at the called taxon
-    max_score = hit_counts[max_taxon];
-    // We probably have a call w/o required support (unless LCA resolved tie)
-    while (max_taxon && max_score < required_score)
-    {
-        max_score = 0;
-        for (auto &kv_pair : hit_counts)
-        {
-            taxid_t taxon = kv_pair.first;
-            // Add to score if taxon in max_taxon's clade
-            if (taxonomy.IsAAncestorOfB(max_taxon, taxon))
-            {
-                max_score += kv_pair.second;
-            }
-        }
-        // Score is now sum of hits at max_taxon and w/in max_taxon clade
-        if (max_score >= required_score)
-            // Kill loop and return, we've got enough support here
-            return max_taxon;
-        else
-            // Run up tree until confidence threshold is met
-            // Run off tree if required score isn't met
-            max_taxon = taxonomy.nodes()[max_taxon].parent_id;
-    }
-
-    return max_taxon;
+    uint32_t required_score = ceil(settings.confidence_threshold * total_minimizers);
+    return taxonomy_index.ResolveTree(taxonomy, context.scan.hit_counts, required_score,
+                                      context.hits, context.path);
 }
 
 std::string Kraken2ServerClassifier::ReportStats(struct timeval time1, struct timeval time2,
@@ -440,29 +1135,91 @@ std::string Kraken2ServerClassifier::ReportStats(struct timeval time1, struct ti
 
     return std::to_string(stats.total_sequences) + " sequences (" + DoubleStatToString(stats.total_bases / 1.0e6, 2) + " Mbp) processed in " + DoubleStatToString(seconds, 2) + "s (" + DoubleStatToString(stats.total_sequences / 1.0e3 / (seconds / 60), 2) + " Kseq/m, " + DoubleStatToString(stats.total_bases / 1.0e6 / (seconds / 60), 2) + " Mbp/m).\n" +
            "\t" + std::to_string(stats.total_classified) + " sequences classified (" + DoubleStatToString(stats.total_classified * 100.0 / stats.total_sequences, 2) + "%)\n" +
-           "\t" + std::to_string(total_unclassified) + " sequences unclassified (" + DoubleStatToString(total_unclassified * 100.0 / stats.total_sequences, 2) + "%)\n";
+           "\t" + std::to_string(total_unclassified) + " sequences unclassified (" + DoubleStatToString(total_unclassified * 100.0 / stats.total_sequences, 2) + "%)\n"
+#ifdef KRAKEN2_COUNT_ALLOCATIONS
+           + "\t" + DoubleStatToString(stats.allocations * 1.0 / stats.total_sequences, 2) + " heap allocations per sequence\n"
+           + "\t" + DoubleStatToString(stats.io_allocations * 1.0 / stats.total_sequences, 2) + " heap allocations per sequence reading and writing\n"
+#endif
+           + "\t" + DoubleStatToString(stats.peak_queued_bases / 1.0e6, 2) + " Mbp peak queued, reads paused " + std::to_string(stats.read_pauses) + " times\n"
+           + "\t" + DoubleStatToString(stats.request_bytes / 1.0e6, 2) + " MB received, " + DoubleStatToString(stats.response_bytes / 1.0e6, 2) + " MB sent (uncompressed)\n"
+           + (stats.peak_reorder_batches > 0 ? "\tresults ordered, up to " + std::to_string(stats.peak_reorder_batches) + " batches held back\n" : "")
+           + "\t" + ReportQueueWaits(stats) + "\n"
+           + (stats.wasted_cpu_us > 0 || stats.dropped_batches > 0 ? "\tcancelled, " + std::to_string(stats.dropped_batches) + " batches dropped, " + DoubleStatToString(stats.wasted_cpu_us / 1.0e6, 2) + " of " + DoubleStatToString(stats.cpu_us / 1.0e6, 2) + " CPU seconds spent on results not delivered\n" : "")
+           + ReportCacheStats(stats, "\t");
+}
+
+std::string Kraken2ServerClassifier::ReportCacheStats(ClassificationStats &stats, const std::string &prefix)
+{
+    if (opts.minimizer_cache <= 0)
+        return "";
+    uint64_t lookups = stats.cache_hits + stats.cache_misses;
+    return prefix + "minimizer cache: " + std::to_string(stats.cache_hits) + " hits, " + std::to_string(stats.cache_misses) + " misses (" + DoubleStatToString(lookups ? stats.cache_hits * 100.0 / lookups : 0.0, 2) + "% hit rate)\n";
+}
+
+std::string Kraken2ServerClassifier::ReportQueueStats(ClassificationStats &stats)
+{
+    uint64_t current, peak;
+    {
+        std::lock_guard<std::mutex> lock(queued_mtx);
+        current = queued_bases;
+        peak = peak_queued_bases;
+    }
+    return DoubleStatToString(current / 1.0e6, 2) + " Mbp queued now, " + DoubleStatToString(peak / 1.0e6, 2) + " Mbp peak (" + DoubleStatToString(stats.peak_queued_bases / 1.0e6, 2) + " Mbp in a single stream), reads paused " + std::to_string(stats.read_pauses) + " times.\n" +
+           ReportQueueWaits(stats) + ".\n" +
+           DoubleStatToString(stats.wasted_cpu_us / 1.0e6, 2) + " of " + DoubleStatToString(stats.cpu_us / 1.0e6, 2) + " CPU seconds classifying spent on results not delivered, " + std::to_string(stats.dropped_batches) + " batches of cancelled streams dropped.\n";
+}
+
+std::string Kraken2ServerClassifier::ReportQueueWaits(ClassificationStats &stats)
+{
+    double mean_ms = stats.scheduled_tasks ? stats.queue_wait_us / 1.0e3 / stats.scheduled_tasks : 0.0;
+    return std::to_string(stats.scheduled_tasks) + " tasks waited " + DoubleStatToString(mean_ms, 2) + " ms on average for a worker, " + DoubleStatToString(stats.peak_queue_wait_us / 1.0e3, 2) + " ms at most";
+}
+
+std::string Kraken2ServerClassifier::ReportSample(
+    const std::string &sample, SampleTally &tally, const ClassificationSettings &settings)
+{
+    ClassificationStats &stats = tally.stats;
+    uint64_t total_unclassified = stats.total_sequences - stats.total_classified;
+    std::cerr << "Sample " << sample << ": " << stats.total_sequences << " sequences ("
+              << DoubleStatToString(stats.total_bases / 1.0e6, 2) << " Mbp), "
+              << stats.total_classified << " classified ("
+              << DoubleStatToString(stats.total_classified * 100.0 / stats.total_sequences, 2) << "%)" << std::endl;
+    std::ostringstream ss;
+    ReportKrakenStyle(ss,
+                      opts.report_zero_counts,
+                      settings.report_kmer_data,
+                      taxonomy,
+                      tally.taxon_counters,
+                      stats.total_sequences,
+                      total_unclassified);
+    return ss.str();
 }
 
 std::string Kraken2ServerClassifier::ReportTotalStats(ClassificationStats &stats)
 {
     uint64_t total_unclassified = stats.total_sequences - stats.total_classified;
+    // no history yet reads as 0% rather than nan
+    uint64_t percent_of = std::max<uint64_t>(stats.total_sequences, 1);
 
     return std::to_string(stats.total_sequences) + " sequences (" + DoubleStatToString(stats.total_bases / 1.0e6, 2) + " Mbp) processed.\n" +
-           std::to_string(stats.total_classified) + " sequences classified (" + DoubleStatToString(stats.total_classified * 100.0 / stats.total_sequences, 2) + "%).\n" +
-           std::to_string(total_unclassified) + " sequences unclassified (" + DoubleStatToString(total_unclassified * 100.0 / stats.total_sequences, 2) + "%).\n";
+           std::to_string(stats.total_classified) + " sequences classified (" + DoubleStatToString(stats.total_classified * 100.0 / percent_of, 2) + "%).\n" +
+           std::to_string(total_unclassified) + " sequences unclassified (" + DoubleStatToString(total_unclassified * 100.0 / percent_of, 2) + "%).\n" +
+           DoubleStatToString(stats.request_bytes / 1.0e6, 2) + " MB received, " + DoubleStatToString(stats.response_bytes / 1.0e6, 2) + " MB sent (uncompressed).\n" +
+           ReportQueueStats(stats) +
+           ReportCacheStats(stats, "");
 }
 
 void Kraken2ServerClassifier::GenerateReport(
-        std::string &results, std::string &summary, Options &opts, Taxonomy &taxonomy,
+        std::string &results, Options &opts,
+        const ClassificationSettings &settings, Taxonomy &taxonomy,
         timeval &tv1, timeval &tv2, ClassificationStats &stats,
-        ClassificationStats &total_stats, taxon_counters_t &taxon_counters, taxon_counters_t &total_taxon_counters,
-        std::mutex &stats_mtx)
+        taxon_counters_map_t &taxon_counters)
 {
     std::ostringstream ss;
     auto total_unclassified = stats.total_sequences - stats.total_classified;
     ReportKrakenStyle(ss,
                       opts.report_zero_counts,
-                      opts.report_kmer_data,
+                      settings.report_kmer_data,
                       taxonomy,
                       taxon_counters,
                       stats.total_sequences,
@@ -471,19 +1228,18 @@ void Kraken2ServerClassifier::GenerateReport(
 
     std::cerr << ReportStats(tv1, tv2, stats) << std::endl;
 
-    if (opts.stats)
-    {
-        stats_mtx.lock();
+    // the server summary is rendered when next asked for
+    AddToHistory(stats, taxon_counters);
+}
 
-        total_stats.total_sequences += stats.total_sequences;
-        total_stats.total_classified += stats.total_classified;
-        total_stats.total_bases += stats.total_bases;
-        for (auto &kv_pair : taxon_counters)
-        {
-            total_taxon_counters[kv_pair.first] += std::move(kv_pair.second);
-        }
-        ss.str(std::string());
-        total_unclassified = total_stats.total_sequences - total_stats.total_classified;
+// Caller holds stats_mtx
+std::string Kraken2ServerClassifier::RenderSummary()
+{
+    std::ostringstream ss;
+    uint64_t total_unclassified = total_stats.total_sequences - total_stats.total_classified;
+    // Until something is classified there are only the zero totals
+    if (total_stats.total_sequences > 0)
+    {
         ReportKrakenStyle(ss,
                           opts.report_zero_counts,
                           opts.report_kmer_data,
@@ -491,13 +1247,10 @@ void Kraken2ServerClassifier::GenerateReport(
                           total_taxon_counters,
                           total_stats.total_sequences,
                           total_unclassified);
-
-        ss << "\n"
-           << ReportTotalStats(total_stats);
-        summary.assign(ss.str());
-
-        stats_mtx.unlock();
+        ss << "\n";
     }
+    ss << ReportTotalStats(total_stats);
+    return ss.str();
 }
 
 std::string Kraken2ServerClassifier::TrimPairInfo(std::string &id)
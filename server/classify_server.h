@@ -1,5 +1,10 @@
 #include <iomanip>
 #include <future>
+#include <charconv>
+#include <map>
+#include <array>
+#include <atomic>
+#include <chrono>
 
 // kraken2
 #include "kraken2_data.h"
@@ -14,23 +19,39 @@
 // kraken2 server
 #include "thread_pool.hpp"
 #include "report_server.h"
+#include "taxonomy_index.h"
+#include "taxon_map.h"
 #include "thread_safe_queue.h"
+#include "packed_sequence.h"
+#include "alloc_counter.h"
+#include "stream_scheduler.h"
 #include "Kraken2.grpc.pb.h"
 
 using namespace kraken2;
 
 using grpc::ServerContext;
 using grpc::ServerReaderWriter;
+using grpc::ServerWriter;
 using grpc::WriteOptions;
 
 using kraken2proto::Kraken2Service;
+using kraken2proto::Kraken2Hitlist;
 using kraken2proto::Kraken2SequenceRequest;
 using kraken2proto::Kraken2SequenceRequestMulti;
 using kraken2proto::Kraken2SequenceResult;
 using kraken2proto::Kraken2SequenceResultMulti;
+using kraken2proto::Kraken2PackedResults;
+using kraken2proto::Kraken2TaxonomyTable;
 using kraken2proto::Kraken2SequenceStreamResult;
+using kraken2proto::Kraken2ClassificationSettings;
+using kraken2proto::Kraken2ClassifyRequest;
+using kraken2proto::Kraken2ClassifyResult;
 
 typedef ServerReaderWriter<Kraken2SequenceStreamResult, Kraken2SequenceRequestMulti> ServerStream;
+// A gRPC stream, or the rings of a shared memory segment
+typedef grpc::ServerReaderWriterInterface<Kraken2SequenceStreamResult, Kraken2SequenceRequestMulti> SequenceStream;
+typedef Kraken2SequenceRequestMulti::HitlistFormat HitlistFormat;
+typedef Kraken2SequenceRequestMulti::ResultFormat ResultFormat;
 
 static const taxid_t AMBIGUOUS_SPAN_TAXON = TAXID_MAX - 2;
 static const taxid_t MATE_PAIR_BORDER_TAXON = TAXID_MAX;
@@ -57,20 +78,251 @@ struct Options {
     int minimum_hit_groups = 2;
     bool use_memory_mapping = false;
     int wait = 0;
+    int minimizer_cache = 0;
+    int chunk_length = 0;
+    int batch_bases = 1000000;
+    int io_threads = 0;
+    uint64_t stream_queued_bases = 100000000;
+    uint64_t max_queued_bases = 1000000000;
+    int reorder_window = 64;
+    // Compression of responses, a level overrides the algorithm and lets gRPC
+    // choose one the client accepts
+    grpc_compression_algorithm response_compression = GRPC_COMPRESS_NONE;
+    grpc_compression_level compression_level = GRPC_COMPRESS_LEVEL_NONE;
+    bool compression_level_set = false;
+    // Also listen on this unix domain socket, if given
+    string unix_socket;
+    // Serve ClassifySharedMemory calls from clients on the same host
+    bool shared_memory = false;
+    // Highest stream priority accepted, higher ones are lowered to it
+    int max_priority = 4;
+};
+
+
+// Classification parameters of a stream, the server's options unless the
+// client gave its own.
+struct ClassificationSettings {
+    double confidence_threshold = 0.0;
+    int minimum_quality_score = 0;
+    int minimum_hit_groups = 2;
+    bool report_kmer_data = false;
 };
 
 
 struct ClassificationStats {
-    uint64_t total_sequences;
-    uint64_t total_bases;
-    uint64_t total_classified;
+    uint64_t total_sequences = 0;
+    uint64_t total_bases = 0;
+    uint64_t total_classified = 0;
+    uint64_t allocations = 0;
+    uint64_t io_allocations = 0;     // reading, splitting and writing batches
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    uint64_t peak_queued_bases = 0;  // received and not yet classified, per stream
+    uint64_t read_pauses = 0;        // reads held back by the queued bases limits
+    uint64_t peak_reorder_batches = 0;  // held back for ordered results, per stream
+    uint64_t request_bytes = 0;      // messages received, before any decompression
+    uint64_t response_bytes = 0;     // messages sent, before any compression
+    uint64_t scheduled_tasks = 0;
+    uint64_t queue_wait_us = 0;      // of all tasks, between being queued and started
+    uint64_t peak_queue_wait_us = 0;
+    uint64_t cpu_us = 0;             // thread CPU time classifying
+    uint64_t dropped_batches = 0;    // left unclassified as the stream was cancelled
+    uint64_t wasted_cpu_us = 0;      // classifying results that were never delivered
+
+    void Merge(const ClassificationStats &other) {
+        total_sequences += other.total_sequences;
+        total_bases += other.total_bases;
+        total_classified += other.total_classified;
+        allocations += other.allocations;
+        io_allocations += other.io_allocations;
+        cache_hits += other.cache_hits;
+        cache_misses += other.cache_misses;
+        peak_queued_bases = std::max(peak_queued_bases, other.peak_queued_bases);
+        read_pauses += other.read_pauses;
+        peak_reorder_batches = std::max(peak_reorder_batches, other.peak_reorder_batches);
+        request_bytes += other.request_bytes;
+        response_bytes += other.response_bytes;
+        scheduled_tasks += other.scheduled_tasks;
+        queue_wait_us += other.queue_wait_us;
+        peak_queue_wait_us = std::max(peak_queue_wait_us, other.peak_queue_wait_us);
+        cpu_us += other.cpu_us;
+        dropped_batches += other.dropped_batches;
+        wasted_cpu_us += other.wasted_cpu_us;
+    }
+};
+
+
+// Slot of the per-worker direct-mapped minimizer to taxon cache
+struct MinimizerCacheEntry {
+    uint64_t minimizer;
+    taxid_t taxon;
+};
+
+
+// Minimizers scanned from (a stretch of) a read, in sequence order.
+struct ScanResult {
+    vector<taxid_t> taxa;
+    taxon_counts_map_t hit_counts;
+    // taxon and k-mer of each new minimizer hit, registered with the read counters
+    vector<std::pair<taxid_t, uint64_t>> hit_groups;
+    // First and last unambiguous minimizers, used to join chunks of a read
+    bool has_first_minimizer = false;
+    uint64_t first_minimizer = UINT64_MAX;
+    taxid_t first_taxon = 0;
+    uint64_t last_minimizer = UINT64_MAX;
+
+    void clear() {
+        taxa.clear();
+        hit_counts.clear();
+        hit_groups.clear();
+        has_first_minimizer = false;
+        first_minimizer = UINT64_MAX;
+        first_taxon = 0;
+        last_minimizer = UINT64_MAX;
+    }
+};
+
+
+// Scratch state for classifying reads. Each pool worker owns one for its
+// lifetime, it is reset between reads rather than rebuilt per batch.
+struct ClassificationContext {
+    std::unique_ptr<MinimizerScanner> scanner;
+    ScanResult scan;
+    vector<string> translated_frames = vector<string>(6);
+    vector<TaxonHit> hits;
+    vector<size_t> path;
+    // Recent lookups, empty when the cache is disabled
+    vector<MinimizerCacheEntry> cache;
+    int cache_shift = 64;
+    // Bases of a packed request, decoded for the scanner
+    std::string unpacked;
+};
+
+
+// A long read split into chunks that are scanned by several pool workers.
+struct ChunkedScan {
+    const std::string *seq;
+    size_t chunk_size;
+    size_t overlap;
+    vector<ScanResult> chunks;
+    vector<ClassificationStats> chunk_stats;
+    std::atomic<size_t> next_chunk{0};
+    size_t chunks_done = 0;
+    std::mutex mtx;
+    std::condition_variable done_cv;
 };
 
 
 struct BatchResults {
    Kraken2SequenceResultMulti k2results;
-   taxon_counters_t taxon_counters;
-   ClassificationStats stats = {0, 0, 0};
+   taxon_counters_map_t taxon_counters;
+   ClassificationStats stats;
+   uint64_t index = 0;  // of the batch within its stream
+   std::string sample;  // tag of the request, if any
+   bool dropped = false;  // stream cancelled, not or only partly classified
+};
+
+
+// Whether the results of a stream are still wanted. Its tasks check before
+// each read, once the client has gone or the call's deadline has passed the
+// rest of the stream is left unclassified.
+class StreamCancellation {
+public:
+    void SetDeadline(std::chrono::system_clock::time_point time) { deadline = time; }
+
+    void Cancel() { cancelled.store(true, std::memory_order_relaxed); }
+
+    bool IsCancelled() const {
+        if (cancelled.load(std::memory_order_relaxed)) {
+            return true;
+        }
+        return deadline != std::chrono::system_clock::time_point::max()
+            && std::chrono::system_clock::now() >= deadline;
+    }
+
+private:
+    std::atomic<bool> cancelled{false};
+    // set before any task is queued
+    std::chrono::system_clock::time_point deadline = std::chrono::system_clock::time_point::max();
+};
+
+
+// Counters and stats of one sample's sequences within a stream, folded into
+// the stream's once its report is written.
+struct SampleTally {
+    taxon_counters_map_t taxon_counters;
+    ClassificationStats stats;
+};
+
+typedef std::map<std::string, SampleTally> sample_tallies_t;
+
+
+// A [first, last) range of a received batch, classified as one task.
+struct BatchRange {
+    int first;
+    int last;
+    uint64_t bases;
+    uint64_t index = 0;  // numbered by the stream in the order received
+};
+
+
+// Holds finished batch results until all those received before them are released.
+class ReorderBuffer {
+public:
+    void Push(BatchResults &&results) {
+        uint64_t index = results.index;
+        pending.emplace(index, std::move(results));
+    }
+
+    // Take the next results in order, if they have finished.
+    std::optional<BatchResults> Pop() {
+        auto it = pending.find(next);
+        if (it == pending.end()) {
+            return {};
+        }
+        BatchResults results = std::move(it->second);
+        pending.erase(it);
+        next++;
+        return results;
+    }
+
+    uint64_t released() const { return next; }
+
+    size_t size() const { return pending.size(); }
+
+private:
+    std::map<uint64_t, BatchResults> pending;
+    uint64_t next = 0;
+};
+
+
+// History of classifications not yet folded into the server's totals.
+struct StatsShard {
+    std::mutex mtx;
+    taxon_counters_map_t taxon_counters;
+    ClassificationStats stats;
+};
+
+
+// A rendered server summary, never changed once published so callers keep
+// reading it however long they hold it.
+struct SummarySnapshot {
+    uint64_t version = 0;  // stats_version it was rendered at
+    std::string summary;
+};
+
+
+// Tasks and bases a synchronous stream has received and not yet classified.
+struct StreamBacklog {
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool ordered = false;
+    uint64_t next_index = 0;  // given to the next task
+    uint64_t released = 0;    // batches written out in order
+    int tasks = 0;
+    uint64_t queued_bases = 0;
+    uint64_t peak_queued_bases = 0;
+    uint64_t read_pauses = 0;
 };
 
 
@@ -97,43 +349,198 @@ public:
      * @brief Classify sequences in a input queue and populate the classification queue.
      */
     void ProcessSequenceStream(
-        ServerContext *context, ServerStream *stream, std::string &results);
+        ServerContext *context, SequenceStream *stream, std::string &results);
     
     /**
-     * @brief Classifies the vector of sequences and populates the string and map with classification
-     *        summary and results respectively.
+     * @brief Split a received batch into [first, last) ranges of similar base count, each
+     *        classified as a separate task.
+     */
+    std::vector<BatchRange> SplitBatch(const Kraken2SequenceRequestMulti &reqs);
+
+    /**
+     * @brief Run a task on the classification thread pool.
+     */
+    void PushTask(std::function<void()> task);
+
+    /**
+     * @brief A queue for the classification tasks of a new stream, see ScheduleTask.
+     */
+    std::shared_ptr<StreamQueue> AddStream();
+
+    /**
+     * @brief Set the priority of a stream from its first message, capped by the server.
+     */
+    void SetStreamPriority(StreamQueue &queue, const Kraken2SequenceRequestMulti &reqs);
+
+    /**
+     * @brief Run a classification task of a stream on the pool. Streams take turns on
+     *        the workers in proportion to their priority rather than first come first served.
+     */
+    void ScheduleTask(const std::shared_ptr<StreamQueue> &queue, std::function<void()> task);
+
+    /**
+     * @brief Add the time the tasks of a stream waited for a worker to its stats.
+     */
+    void AddQueueWaits(const StreamQueue &queue, ClassificationStats &stats);
+
+    /**
+     * @brief Count bases received by any stream and not yet classified.
+     */
+    void QueueBases(uint64_t bases);
+
+    /**
+     * @brief Remove classified bases from the server wide count, resuming paused streams
+     *        if there is now room.
+     */
+    void DequeueBases(uint64_t bases);
+
+    /**
+     * @brief Whether streams may read more while under the server wide limit on queued bases.
+     *        If not and resume is given, it is called once there is room.
+     */
+    bool QueueHasRoom(std::function<void()> resume = nullptr);
+
+    /**
+     * @brief Block until the server wide queued bases are under the limit.
+     */
+    void WaitForQueueRoom();
+
+    /**
+     * @brief Whether a stream with this many bases queued, and batches not yet released
+     *        in order, may read more.
+     */
+    bool StreamHasRoom(uint64_t stream_queued_bases, uint64_t unreleased_batches = 0);
+
+    /**
+     * @brief Classifies sequences [first, last) of the batch and populates the string and map with
+     *        classification summary and results respectively. Sequences are scanned in place from the request.
+     *        Stops before the next read once the stream is cancelled, returning false.
      */
     bool ProcessBatch(
-        Kraken2SequenceRequestMulti reqs,
+        std::shared_ptr<Kraken2SequenceRequestMulti> reqs, const BatchRange &range,
+        const ClassificationSettings &settings, const StreamCancellation &cancellation,
         ThreadSafeQueue<BatchResults> *result_q);
 
     /**
-     * @brief Return a summary of historical classifications.
+     * @brief The settings a stream asked for in its first message, over the server's defaults.
+     */
+    ClassificationSettings StreamSettings(const Kraken2SequenceRequestMulti &reqs);
+
+    /**
+     * @brief Add the stats and taxon counters of a batch to those of its stream. Results
+     *        dropped or not delivered to the client count as wasted CPU time.
+     */
+    void MergeResults(
+        BatchResults &res, taxon_counters_map_t &stream_taxon_counters,
+        ClassificationStats &stream_stats, sample_tallies_t &samples, bool delivered);
+
+    /**
+     * @brief Return batch results once written to the client so their storage is reused.
+     */
+    void RecycleResults(BatchResults &&results);
+
+    /**
+     * @brief A cleared request message to read the next batch into. It is recycled in
+     *        the same way once the last task classifying the batch drops it.
+     */
+    std::shared_ptr<Kraken2SequenceRequestMulti> SpareRequest();
+
+    /**
+     * @brief Generate the report of a finished stream and add it to the server's history.
      */
-    const char *GetSummary();
+    void FinishStream(
+        timeval &tv1, timeval &tv2, const ClassificationSettings &settings,
+        ClassificationStats &stream_stats, taxon_counters_map_t &stream_taxon_counters,
+        sample_tallies_t &samples, std::string &results,
+        std::vector<Kraken2SequenceStreamResult> &sample_summaries);
+
+    /**
+     * @brief Stream the taxonomy of the database as tables of IDs, parents, names and ranks.
+     */
+    void WriteTaxonomy(ServerContext *context, ServerWriter<Kraken2TaxonomyTable> *writer);
+
+    /**
+     * @brief Classify the few sequences of a unary request on the pool and wait for them.
+     *        Stats are added to the server's history as for a stream.
+     */
+    void ClassifyRequest(
+        ServerContext *context, const Kraken2ClassifyRequest &req, Kraken2ClassifyResult &result);
+
+    /**
+     * @brief Return a summary of historical classifications, rendered only if there are
+     *        classifications since it was last asked for. While another caller renders
+     *        it the previous summary is returned.
+     */
+    std::shared_ptr<const SummarySnapshot> GetSummary();
 
 private:
     // Database and Historical Stats
     Options opts;
     Taxonomy taxonomy;
+    TaxonomyIndex taxonomy_index;
     CompactHashTable hash;
     IndexOptions idx_opts;
-    taxon_counters_t total_taxon_counters;
-    ClassificationStats total_stats = {0, 0, 0};
-    std::string summary;
+    // Finished streams and calls merge into one of the shards, the totals
+    // and summary are only brought up to date when the summary is asked for
+    std::array<StatsShard, 16> stats_shards;
+    std::atomic<uint64_t> stats_version{0};  // bumped on each merge into a shard
+    // Guards the totals, held while folding in the shards and rendering
     std::mutex stats_mtx;
+    taxon_counters_map_t total_taxon_counters;
+    ClassificationStats total_stats;
+    // The last summary rendered, replaced whole and only through
+    // std::atomic_load and std::atomic_store
+    std::shared_ptr<const SummarySnapshot> summary_snapshot;
+    // Destroyed after the pool, whose tasks run from it
+    StreamScheduler scheduler;
     BS::thread_pool pool;
+    // Results already sent to a client, kept so their storage can be reused
+    ThreadSafeQueue<BatchResults> spare_results;
+    // Requests already classified, kept for the same reason
+    ThreadSafeQueue<std::unique_ptr<Kraken2SequenceRequestMulti>> spare_requests;
+    // Bases received by all streams and not yet classified, and streams
+    // waiting to read until there is room
+    std::mutex queued_mtx;
+    std::condition_variable queued_cv;
+    uint64_t queued_bases = 0;
+    uint64_t peak_queued_bases = 0;
+    std::vector<std::function<void()>> queue_waiters;
+
+    ClassificationContext &WorkerContext();
 
-    void AddHitlistString(ostringstream &oss, vector<taxid_t> &taxa, Taxonomy &taxonomy);
+    BatchResults SpareResults();
 
-    Kraken2SequenceResult ClassifySequence(
-        Sequence &dna,
+    void ResultsHandler(
+        SequenceStream *stream,
+        taxon_counters_map_t &stream_taxon_counters,
+        ClassificationStats &stream_stats, sample_tallies_t &samples,
+        ThreadSafeQueue<BatchResults> *results_queue, StreamBacklog &backlog,
+        StreamCancellation &cancellation);
+
+    void AddHitlistString(std::string &out, vector<taxid_t> &taxa, Taxonomy &taxonomy);
+
+    void AddPackedHitlist(Kraken2Hitlist &out, vector<taxid_t> &taxa, Taxonomy &taxonomy);
+
+    // Taxon of a minimizer, through the worker's cache when it has one
+    taxid_t LookupMinimizer(ClassificationContext &context, uint64_t minimizer, ClassificationStats &stats);
+
+    void ScanMinimizers(
+        ClassificationContext &context, const std::string &seq, size_t start, size_t finish,
+        ScanResult &scan, ClassificationStats &stats);
+
+    void ScanChunks(std::shared_ptr<ChunkedScan> job);
+
+    void ScanChunked(ClassificationContext &context, const std::string &seq, ClassificationStats &stats);
+
+    void ClassifySequence(
+        const std::string &id, const std::string &seq,
         CompactHashTable &hash, Taxonomy &taxonomy, IndexOptions &idx_opts,
-        Options &opts, ClassificationStats &stats, MinimizerScanner &scanner,
-        vector<taxid_t> &taxa, taxon_counts_t &hit_counts,
-        vector<string> &tx_frames, taxon_counters_t &curr_taxon_counts);
+        Options &opts, const ClassificationSettings &settings,
+        ClassificationStats &stats, ClassificationContext &context,
+        taxon_counters_map_t &curr_taxon_counts, HitlistFormat hitlist_format,
+        ResultFormat result_format, Kraken2SequenceResultMulti &results);
 
-    void MaskLowQualityBases(Sequence &dna, int minimum_quality_score);
+    void MaskLowQualityBases(const Kraken2SequenceRequest &req, std::string &seq, int minimum_quality_score);
 
     void ProcessFile(
         Sequence &seq,
@@ -148,12 +555,30 @@ private:
 
     std::string ReportTotalStats(ClassificationStats &stats);
 
-    void GenerateReport(
-        std::string &results, std::string &summary, Options &opts, Taxonomy &taxonomy,
-        timeval &tv1, timeval &tv2, ClassificationStats &stats, ClassificationStats &total_stats,
-        taxon_counters_t &taxon_counters, taxon_counters_t &total_taxon_counters, std::mutex &stats_mtx);
+    std::string ReportCacheStats(ClassificationStats &stats, const std::string &prefix);
 
-    taxid_t ResolveTree(taxon_counts_t &hit_counts, Taxonomy &taxonomy, size_t total_minimizers, Options &opts);
+    std::string ReportQueueStats(ClassificationStats &stats);
+
+    std::string ReportQueueWaits(ClassificationStats &stats);
+
+    void AddToHistory(ClassificationStats &stats, taxon_counters_map_t &taxon_counters);
+
+    void FoldStatsShards();
+
+    std::string RenderSummary();
+
+    std::string ReportSample(
+        const std::string &sample, SampleTally &tally, const ClassificationSettings &settings);
+
+    void GenerateReport(
+        std::string &results, Options &opts,
+        const ClassificationSettings &settings, Taxonomy &taxonomy,
+        timeval &tv1, timeval &tv2, ClassificationStats &stats,
+        taxon_counters_map_t &taxon_counters);
+
+    taxid_t ResolveTree(
+        ClassificationContext &context, Taxonomy &taxonomy, size_t total_minimizers,
+        const ClassificationSettings &settings);
 
     std::string TrimPairInfo(std::string &id);
 
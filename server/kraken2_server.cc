@@ -1,5 +1,10 @@
 #include <getopt.h>
+#include <cctype>
+#include <cerrno>
 #include <csignal>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
 
 #include <grpc/grpc.h>
 #include <grpc++/server.h>
@@ -9,10 +14,13 @@
 
 #include "messages.h"
 #include "classify_server.h"
+#include "shared_ring.h"
 
 using grpc::ResourceQuota;
 using grpc::Server;
+using grpc::ServerAsyncReaderWriter;
 using grpc::ServerBuilder;
+using grpc::ServerCompletionQueue;
 using grpc::ServerContext;
 using grpc::ServerReader;
 using grpc::ServerReaderWriter;
@@ -28,10 +36,132 @@ using kraken2proto::Kraken2ShutdownResult;
 using kraken2proto::Kraken2SequenceRequest;
 using kraken2proto::Kraken2SequenceStreamResult;
 using kraken2proto::Kraken2Service;
+using kraken2proto::Kraken2SharedMemoryRequest;
+using kraken2proto::Kraken2SharedMemoryResult;
+using kraken2proto::Kraken2TaxonomyRequest;
 
+// ClassifyStream served on completion queues, the other endpoints stay synchronous
+typedef Kraken2Service::WithAsyncMethod_ClassifyStream<Kraken2Service::Service> AsyncService;
+typedef ServerAsyncReaderWriter<Kraken2SequenceStreamResult, Kraken2SequenceRequestMulti> AsyncServerStream;
 
 
-class ServiceImpl final : public Kraken2Service::Service {
+/**
+ * @brief Whether a call came from this host, over a unix socket or the loopback interface.
+ *        gRPC gives peers as "unix:<path>", "ipv4:<address>:<port>" or
+ *        "ipv6:[<address>]:<port>", the brackets percent-encoded by newer versions.
+ */
+bool LocalPeer(const std::string &peer) {
+    for (const char *prefix : {"unix:", "unix-abstract:", "ipv4:127.",
+                               "ipv6:[::1]", "ipv6:%5B::1%5D",
+                               "ipv6:[::ffff:127.", "ipv6:%5B::ffff:127."}) {
+        if (peer.compare(0, strlen(prefix), prefix) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * @brief The rings of a shared memory segment as a classification stream, so they are
+ *        served by ProcessSequenceStream as a gRPC stream would be. Waits on the rings
+ *        give up once the controlling call is cancelled. Results too large for the ring
+ *        are split across messages. If one still does not fit, reading stops so the
+ *        call can fail.
+ */
+class SharedMemoryStream final : public SequenceStream {
+
+public:
+    SharedMemoryStream(ServerContext *context, SharedMemorySegment *segment)
+    : segment(segment), cancelled([context] { return context->IsCancelled(); })
+    {}
+
+    void SendInitialMetadata() override {}
+
+    bool NextMessageSize(uint32_t *sz) override {
+        return segment->requests().NextMessageSize(sz, cancelled);
+    }
+
+    bool Read(Kraken2SequenceRequestMulti *msg) override {
+        if (too_large) {
+            return false;
+        }
+        return segment->requests().Read(msg, cancelled);
+    }
+
+    bool Write(const Kraken2SequenceStreamResult &msg, WriteOptions options) override {
+        if (msg.ByteSizeLong() <= segment->results().MaxMessageSize() || !msg.has_classifications()) {
+            return WriteMessage(msg);
+        }
+        const Kraken2SequenceResultMulti &results = msg.classifications();
+        return WriteRange(results, 0, std::max(results.classes_size(), results.packed().ids_size()));
+    }
+
+    // A result did not fit the ring even on its own
+    bool TooLarge() const { return too_large; }
+
+private:
+    SharedMemorySegment *segment;
+    CancelledCheck cancelled;
+    std::atomic<bool> too_large{false};
+    Kraken2SequenceStreamResult part;
+
+    bool WriteMessage(const Kraken2SequenceStreamResult &msg) {
+        if (msg.ByteSizeLong() > segment->results().MaxMessageSize()) {
+            too_large = true;
+            return false;
+        }
+        return segment->results().Write(msg, cancelled);
+    }
+
+    // Write the results of reads [first, last), halving the range until each part fits
+    bool WriteRange(const Kraken2SequenceResultMulti &results, int first, int last) {
+        CopyResults(results, first, last, part.mutable_classifications());
+        if (part.ByteSizeLong() <= segment->results().MaxMessageSize() || last - first == 1) {
+            return WriteMessage(part);
+        }
+        int middle = first + (last - first) / 2;
+        return WriteRange(results, first, middle) && WriteRange(results, middle, last);
+    }
+
+    // Columns of packed results are either empty or hold a value for every read
+    static void CopyResults(
+            const Kraken2SequenceResultMulti &from, int first, int last, Kraken2SequenceResultMulti *to) {
+        to->Clear();
+        const Kraken2PackedResults &packed = from.packed();
+        Kraken2PackedResults *to_packed = to->mutable_packed();
+        for (int i = first; i < last; ++i) {
+            if (i < from.classes_size()) {
+                *to->add_classes() = from.classes(i);
+            }
+            if (i < packed.ids_size()) {
+                to_packed->add_ids(packed.ids(i));
+            }
+            if (i < packed.classified_size()) {
+                to_packed->add_classified(packed.classified(i));
+            }
+            if (i < packed.tax_ids_size()) {
+                to_packed->add_tax_ids(packed.tax_ids(i));
+            }
+            if (i < packed.sizes_size()) {
+                to_packed->add_sizes(packed.sizes(i));
+            }
+            if (i < packed.hitlists_size()) {
+                to_packed->add_hitlists(packed.hitlists(i));
+            }
+            if (i < packed.packed_hitlists_size()) {
+                *to_packed->add_packed_hitlists() = packed.packed_hitlists(i);
+            }
+        }
+        if (packed.ids_size() == 0) {
+            to->clear_packed();
+        }
+    }
+};
+
+
+template <class Base>
+class ServiceImpl final : public Base {
 
 public:
     ServiceImpl(Options opts, Kraken2ServerClassifier *classifier, std::promise<void> *exit_requested)
@@ -50,7 +180,7 @@ public:
 
         // Only return summary if the server is recording history.
         if (options.stats) {
-            results->set_summary(classifier->GetSummary());
+            results->set_summary(classifier->GetSummary()->summary);
         }
         // Else indicate to the user it is not available.
         else {
@@ -89,6 +219,20 @@ public:
         return Status::OK;
     }
 
+    /**
+     * @brief Endpoint to stream the database taxonomy, so clients can resolve
+     *        names and lineages of packed results locally.
+     */
+    Status GetTaxonomy(
+            ServerContext *context, const Kraken2TaxonomyRequest *req,
+            ServerWriter<Kraken2TaxonomyTable> *writer) override {
+        if (!classifier->index_available) {
+            return IndexStatus();
+        }
+        classifier->WriteTaxonomy(context, writer);
+        return Status::OK;
+    }
+
     /**
      * @brief Endpoint to classify a stream of sequences and return
      *        a stream of classifications as response.
@@ -113,6 +257,80 @@ public:
         return Status::OK;
     }
 
+    /**
+     * @brief Endpoint to classify a few sequences in a single call. The batch is classified
+     *        on the pool without a stream's results thread, and a report is only generated
+     *        if asked for.
+     */
+    Status Classify(
+            ServerContext *context, const Kraken2ClassifyRequest *req,
+            Kraken2ClassifyResult *result) override {
+        if (!classifier->index_available) {
+            return IndexStatus();
+        }
+        classifier->ClassifyRequest(context, *req, *result);
+        if (context->IsCancelled()) {
+            return Status::CANCELLED;
+        }
+        return Status::OK;
+    }
+
+    /**
+     * @brief Endpoint to classify sequences exchanged through a shared memory segment
+     *        created by a client on the same host. The call lasts as long as the stream.
+     */
+    Status ClassifySharedMemory(
+            ServerContext *context, const Kraken2SharedMemoryRequest *req,
+            Kraken2SharedMemoryResult *result) override {
+        if (!options.shared_memory) {
+            return Status(StatusCode::UNIMPLEMENTED, "Shared memory streams are not enabled on this server.");
+        }
+        // The segment is named by the caller and unlinked once open, so only
+        // clients on this host may name one.
+        if (!LocalPeer(context->peer())) {
+            return Status(StatusCode::PERMISSION_DENIED,
+                "Shared memory streams are only served to clients on the same host.");
+        }
+        if (!classifier->index_available) {
+            return IndexStatus();
+        }
+        std::unique_ptr<SharedMemorySegment> segment;
+        try {
+            segment = SharedMemorySegment::Open(req->name());
+        }
+        catch (const std::exception &ex) {
+            return Status(StatusCode::INVALID_ARGUMENT, ex.what());
+        }
+        // Both sides have it mapped now, nothing is left behind if either exits.
+        segment->Unlink();
+
+        SharedMemoryStream stream(context, segment.get());
+        std::string results;
+
+        classifier->ProcessSequenceStream(context, &stream, std::ref(results));
+
+        // If the client is still there, finish with a message containing the summary.
+        if (!context->IsCancelled() && !stream.TooLarge()) {
+            Kraken2SequenceStreamResult summary;
+            summary.set_summary(results);
+            stream.Write(summary, WriteOptions());
+        }
+        segment->results().Close();
+
+        if (stream.TooLarge()) {
+            return Status(StatusCode::RESOURCE_EXHAUSTED,
+                "A result did not fit the shared memory ring, results were lost. Use larger rings.");
+        }
+        return Status::OK;
+    }
+
+    grpc::Status IndexStatus(){
+        if(!classifier->index_available) {
+            return classifier->index_broken ? IndexError : IndexNotLoaded;
+        }
+        return IndexLoaded;
+    } 
+
 private:
     Options options;
     Kraken2ServerClassifier *classifier;
@@ -122,22 +340,399 @@ private:
     grpc::Status IndexError = grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "There was an error loading the index, the server will remain unavailable without intervention.");
     grpc::Status IndexLoaded = grpc::Status(grpc::StatusCode::OK, "Index loaded.");
 
-    grpc::Status IndexStatus(){
-        if(!classifier->index_available) {
-            return classifier->index_broken ? IndexError : IndexNotLoaded;
+};
+
+
+/**
+ * @brief A ClassifyStream call served asynchronously. The completion queue threads only
+ *        issue reads and writes, batches are classified on the classifier's thread pool
+ *        and whichever thread finishes an operation moves the call on. The call deletes
+ *        itself once finished and done.
+ */
+class AsyncClassifyStream {
+
+public:
+    /**
+     * @brief Wait for the next ClassifyStream call on the completion queue.
+     */
+    static void Listen(
+            ServiceImpl<AsyncService> *service, ServerCompletionQueue *cq,
+            Kraken2ServerClassifier *classifier) {
+        new AsyncClassifyStream(service, cq, classifier);
+    }
+
+    /**
+     * @brief Handle a completed operation, given the tag and status from the completion queue.
+     */
+    static void Proceed(void *tag, bool ok) {
+        Tag *t = static_cast<Tag*>(tag);
+        switch (t->op) {
+            case REQUEST: t->call->OnRequest(ok); break;
+            case READ: t->call->OnRead(ok); break;
+            case WRITE: t->call->OnWrite(ok); break;
+            case FINISH: t->call->OnFinish(); break;
+            case DONE: t->call->OnDone(); break;
         }
-        return IndexLoaded;
-    } 
+    }
+
+    /**
+     * @brief Wait, up to a timeout, for all calls to finish once the server is shut down.
+     */
+    static bool WaitForAll(std::chrono::seconds timeout) {
+        std::unique_lock<std::mutex> lock(live_mtx);
+        return live_cv.wait_for(lock, timeout, [] { return live_calls == 0; });
+    }
+
+private:
+    enum Operation {REQUEST, READ, WRITE, FINISH, DONE};
+    struct Tag {
+        AsyncClassifyStream *call;
+        Operation op;
+    };
+
+    ServiceImpl<AsyncService> *service;
+    ServerCompletionQueue *cq;
+    Kraken2ServerClassifier *classifier;
+    ServerContext context;
+    AsyncServerStream stream;
+    Tag request_tag = {this, REQUEST};
+    Tag read_tag = {this, READ};
+    Tag write_tag = {this, WRITE};
+    Tag finish_tag = {this, FINISH};
+    Tag done_tag = {this, DONE};
+
+    // message being received, and the one being written
+    std::shared_ptr<Kraken2SequenceRequestMulti> request;
+    Kraken2SequenceStreamResult response;
+    ThreadSafeQueue<BatchResults> results_queue;
+    // batches waiting for a worker
+    std::shared_ptr<StreamQueue> queue;
+    // set once the call is done early, batches still queued are then dropped
+    StreamCancellation cancellation;
 
+    // Guards everything below, touched by completion queue and pool threads
+    std::mutex mtx;
+    int batches_in_flight = 0;
+    uint64_t queued_bases = 0;
+    // taken from the first message, with the order of results
+    ClassificationSettings settings;
+    // results released in the order batches were received
+    bool ordered = false;
+    uint64_t next_index = 0;
+    // stream fields are taken from the first message, even one without reads
+    bool first_read = true;
+    ReorderBuffer reorder;
+    // no read outstanding as too many bases are queued
+    bool read_paused = false;
+    // registered to resume once the server wide queue has room
+    bool queue_waiter = false;
+    bool reads_done = false;
+    bool writing = false;
+    bool reporting = false;
+    // a write failed, the client has gone
+    bool broken = false;
+    // only summaries are written from now on
+    bool finishing = false;
+    // the call is deleted once both its finish and done tags are back
+    bool finished = false;
+    bool done = false;
+
+    // Stats for the whole stream, and for each sample it carries
+    taxon_counters_map_t stream_taxon_counters;
+    ClassificationStats stream_stats;
+    sample_tallies_t samples;
+    struct timeval tv1, tv2;
+    std::string results;
+    // sample summaries then the stream's, written one at a time
+    std::deque<Kraken2SequenceStreamResult> summaries;
+
+    static std::mutex live_mtx;
+    static std::condition_variable live_cv;
+    static int live_calls;
+
+    AsyncClassifyStream(
+            ServiceImpl<AsyncService> *service, ServerCompletionQueue *cq,
+            Kraken2ServerClassifier *classifier)
+    : service(service), cq(cq), classifier(classifier), stream(&context) {
+        {
+            std::lock_guard<std::mutex> lock(live_mtx);
+            live_calls++;
+        }
+        // a cancelled call is only seen through the done tag, IsCancelled
+        // may not be used before it
+        context.AsyncNotifyWhenDone(&done_tag);
+        service->RequestClassifyStream(&context, &stream, cq, cq, &request_tag);
+    }
+
+    ~AsyncClassifyStream() {
+        {
+            std::lock_guard<std::mutex> lock(live_mtx);
+            live_calls--;
+        }
+        live_cv.notify_all();
+    }
+
+    void OnRequest(bool ok) {
+        if (!ok) {
+            // server is shutting down, the done tag only comes back for calls that start
+            delete this;
+            return;
+        }
+        // take the next call while this one runs
+        Listen(service, cq, classifier);
+
+        if (!classifier->index_available) {
+            stream.Finish(service->IndexStatus(), &finish_tag);
+            return;
+        }
+        std::cerr << "Starting stream handler." << std::endl;
+        gettimeofday(&tv1, nullptr);
+        std::lock_guard<std::mutex> lock(mtx);
+        settings = classifier->StreamSettings(Kraken2SequenceRequestMulti::default_instance());
+        queue = classifier->AddStream();
+        cancellation.SetDeadline(context.deadline());
+        writing = true;
+        stream.SendInitialMetadata(&write_tag);
+        ReadNext();
+    }
+
+    void ReadNext() {
+        request = classifier->SpareRequest();
+        stream.Read(request.get(), &read_tag);
+    }
+
+    void OnRead(bool ok) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!ok) {
+            // client is done writing, or gone
+            reads_done = true;
+            MaybeReport();
+            return;
+        }
+        uint64_t allocations = ThreadAllocationCount();
+        stream_stats.request_bytes += request->ByteSizeLong();
+        if (first_read) {
+            first_read = false;
+            ordered = request->ordered();
+            settings = classifier->StreamSettings(*request);
+            classifier->SetStreamPriority(*queue, *request);
+        }
+        for (auto &range : classifier->SplitBatch(*request)) {
+            range.index = next_index++;
+            batches_in_flight++;
+            queued_bases += range.bases;
+            stream_stats.peak_queued_bases = std::max(stream_stats.peak_queued_bases, queued_bases);
+            classifier->QueueBases(range.bases);
+            classifier->ScheduleTask(queue,
+                [this, reqs = request, range, settings = settings] {
+                    classifier->ProcessBatch(reqs, range, settings, cancellation, &results_queue);
+                    // may resume other paused streams, so not under our lock
+                    classifier->DequeueBases(range.bases);
+                    OnBatchDone(range.bases);
+                });
+        }
+        ContinueReading();
+        stream_stats.io_allocations += ThreadAllocationCount() - allocations;
+    }
+
+    // Read the next message unless too many bases are queued, in which case
+    // reading resumes as batches finish. Without an outstanding read gRPC flow
+    // control holds back the client. Caller holds mtx.
+    void ContinueReading() {
+        bool room = classifier->StreamHasRoom(queued_bases, ordered ? next_index - reorder.released() : 0);
+        if (room && queue_waiter) {
+            room = classifier->QueueHasRoom();
+        }
+        else if (room && !classifier->QueueHasRoom([this] { OnQueueRoom(); })) {
+            queue_waiter = true;
+            room = false;
+        }
+        if (!room) {
+            if (!read_paused) {
+                read_paused = true;
+                stream_stats.read_pauses++;
+            }
+            return;
+        }
+        read_paused = false;
+        ReadNext();
+    }
+
+    void OnQueueRoom() {
+        std::lock_guard<std::mutex> lock(mtx);
+        queue_waiter = false;
+        if (read_paused) {
+            ContinueReading();
+        }
+        MaybeReport();
+    }
+
+    void OnBatchDone(uint64_t bases) {
+        std::lock_guard<std::mutex> lock(mtx);
+        batches_in_flight--;
+        queued_bases -= bases;
+        if (read_paused) {
+            ContinueReading();
+        }
+        WriteNext();
+        MaybeReport();
+    }
+
+    void OnWrite(bool ok) {
+        std::unique_lock<std::mutex> lock(mtx);
+        writing = false;
+        if (!ok) {
+            broken = true;
+            cancellation.Cancel();
+        }
+        if (finishing) {
+            lock.unlock();
+            WriteSummary();
+            return;
+        }
+        WriteNext();
+        MaybeReport();
+    }
+
+    // Start writing the next results, if any and no write is in progress. Caller holds mtx.
+    void WriteNext() {
+        while (!writing) {
+            std::optional<BatchResults> res = NextResults();
+            if (!res.has_value()) {
+                break;
+            }
+            bool send = !res->dropped && !broken && !cancellation.IsCancelled();
+            classifier->MergeResults(*res, stream_taxon_counters, stream_stats, samples, send);
+            if (send) {
+                // serialized by Write, so the results can be swapped back out
+                // straight after and recycled
+                uint64_t allocations = ThreadAllocationCount();
+                response.mutable_classifications()->Swap(&res->k2results);
+                stream_stats.response_bytes += response.ByteSizeLong();
+                writing = true;
+                stream.Write(response, WriteOptions().set_buffer_hint(), &write_tag);
+                response.mutable_classifications()->Swap(&res->k2results);
+                stream_stats.io_allocations += ThreadAllocationCount() - allocations;
+            }
+            classifier->RecycleResults(std::move(*res));
+        }
+        // releasing ordered results may make room to read more
+        if (ordered && read_paused) {
+            ContinueReading();
+        }
+    }
+
+    // The next finished results, held back until those before them if ordered. Caller holds mtx.
+    std::optional<BatchResults> NextResults() {
+        if (!ordered) {
+            return results_queue.try_pop();
+        }
+        while (std::optional<BatchResults> res = results_queue.try_pop()) {
+            reorder.Push(std::move(*res));
+        }
+        stream_stats.peak_reorder_batches = std::max<uint64_t>(stream_stats.peak_reorder_batches, reorder.size());
+        return reorder.Pop();
+    }
+
+    // Once everything is classified and written, generate the report on the pool. Caller holds mtx.
+    void MaybeReport() {
+        if (!reads_done || batches_in_flight > 0 || writing || queue_waiter || reporting) {
+            return;
+        }
+        reporting = true;
+        classifier->PushTask([this] { Report(); });
+    }
+
+    void Report() {
+        gettimeofday(&tv2, nullptr);
+        classifier->AddQueueWaits(*queue, stream_stats);
+        std::vector<Kraken2SequenceStreamResult> sample_summaries;
+        classifier->FinishStream(
+            tv1, tv2, settings, stream_stats, stream_taxon_counters, samples, results,
+            sample_summaries);
+        std::cerr << "Finished stream handler." << std::endl;
+
+        for (auto &summary : sample_summaries) {
+            summaries.push_back(std::move(summary));
+        }
+        summaries.emplace_back();
+        summaries.back().set_summary(results);
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            finishing = true;
+        }
+        WriteSummary();
+    }
+
+    // Nothing else is in flight once finishing, the summaries are written in turn and the
+    // call finished with the last. Finish outside the lock, the call may be deleted as
+    // soon as it completes.
+    void WriteSummary() {
+        bool client_gone;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            client_gone = broken;
+        }
+        // If connection is open, send the summaries.
+        if (client_gone || summaries.empty()) {
+            stream.Finish(Status::OK, &finish_tag);
+            return;
+        }
+        response = std::move(summaries.front());
+        summaries.pop_front();
+        if (summaries.empty()) {
+            stream.WriteAndFinish(response, WriteOptions(), Status::OK, &finish_tag);
+        }
+        else {
+            stream.Write(response, WriteOptions(), &write_tag);
+        }
+    }
+
+    void OnFinish() {
+        bool last;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            finished = true;
+            last = done;
+        }
+        if (last) {
+            delete this;
+        }
+    }
+
+    // Comes back once the call is over, which is before it is finished if the client
+    // has gone or the deadline passed. Batches still queued are then dropped, those
+    // in progress stop at their next read.
+    void OnDone() {
+        if (context.IsCancelled()) {
+            cancellation.Cancel();
+        }
+        bool last;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            done = true;
+            last = finished;
+        }
+        if (last) {
+            delete this;
+        }
+    }
 };
 
+std::mutex AsyncClassifyStream::live_mtx;
+std::condition_variable AsyncClassifyStream::live_cv;
+int AsyncClassifyStream::live_calls = 0;
+
 // This is used in a lambda below and passed to std::signal, for which we
 // need a void(*)(int) 
 std::promise<void> *exit_requested;
 
 void RunServer(Options opts, Kraken2ServerClassifier *classifier) {
     std::string server_address = opts.host + ":" + std::to_string(opts.port);
-    ServiceImpl service(opts, classifier, exit_requested);
+    // Only one of these is registered, depending on whether streams are served
+    // synchronously, a gRPC thread each, or on completion queues.
+    ServiceImpl<Kraken2Service::Service> sync_service(opts, classifier, exit_requested);
+    ServiceImpl<AsyncService> async_service(opts, classifier, exit_requested);
     // Sets the max number of concurrent requests
     ResourceQuota rq;
     if (opts.max_queue > 0){
@@ -150,10 +745,32 @@ void RunServer(Options opts, Kraken2ServerClassifier *classifier) {
     // rq.Resize(new_memory_allocation);
     ServerBuilder builder;
     builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+    // local clients can skip the TCP stack
+    if (!opts.unix_socket.empty()) {
+        server_address += " and unix:" + opts.unix_socket;
+        builder.AddListeningPort("unix:" + opts.unix_socket, grpc::InsecureServerCredentials());
+    }
     // don't use port if already in use
     builder.AddChannelArgument(GRPC_ARG_ALLOW_REUSEPORT, 0);
     builder.SetResourceQuota(rq);
-    builder.RegisterService(&service);
+    // Requests are decompressed whatever the client chose, responses are
+    // compressed if asked
+    if (opts.compression_level_set) {
+        builder.SetDefaultCompressionLevel(opts.compression_level);
+    }
+    else if (opts.response_compression != GRPC_COMPRESS_NONE) {
+        builder.SetDefaultCompressionAlgorithm(opts.response_compression);
+    }
+    std::vector<std::unique_ptr<ServerCompletionQueue>> cqs;
+    if (opts.io_threads > 0) {
+        builder.RegisterService(&async_service);
+        for (int i = 0; i < opts.io_threads; ++i) {
+            cqs.push_back(builder.AddCompletionQueue());
+        }
+    }
+    else {
+        builder.RegisterService(&sync_service);
+    }
     // allow 128Mb messages
     builder.SetMaxSendMessageSize(128 * 1024 * 1024);
     builder.SetMaxMessageSize(128 * 1024 * 1024);
@@ -166,6 +783,17 @@ void RunServer(Options opts, Kraken2ServerClassifier *classifier) {
     } else {
         std::cout << "Server listening on " << server_address
                   << ". Press Ctrl-C to end." << std::endl;
+        std::vector<std::thread> io_threads;
+        for (auto &cq : cqs) {
+            AsyncClassifyStream::Listen(&async_service, cq.get(), classifier);
+            io_threads.emplace_back([cq = cq.get()] {
+                void *tag;
+                bool ok;
+                while (cq->Next(&tag, &ok)) {
+                    AsyncClassifyStream::Proceed(tag, ok);
+                }
+            });
+        }
         // handle interrupts
         auto handler = [](int s) { exit_requested->set_value(); };
         // TODO: what's the actual behaviour here, i.e. what does Shutdown() do?
@@ -177,6 +805,14 @@ void RunServer(Options opts, Kraken2ServerClassifier *classifier) {
         auto f = exit_requested->get_future();
         f.wait();
         server->Shutdown();
+        if (!cqs.empty()) {
+            // streams still being classified need their queue to finish
+            if (!AsyncClassifyStream::WaitForAll(std::chrono::seconds(60))) {
+                std::cerr << "Streams still open at shutdown." << std::endl;
+            }
+            for (auto &cq : cqs) { cq->Shutdown(); }
+            for (auto &t : io_threads) { t.join(); }
+        }
     }
 }
 
@@ -192,17 +828,59 @@ void Usage(int exit_code) {
               << "\t-s, -S, --no-stats              Do not track statistics of all processed sequences on this server. Saves memory long-term." << std::endl
               << "\t-i, -I  --host-ip               Server IP address (default: localhost)." << std::endl
               << "\t-p, -P, --port [int]            Port number on which to listen for requests (0 - 65535, default 8080.)" << std::endl
-              << "\t-k, -K, --report-kmer           Include distinct k-mers in reports" << std::endl
+              << "\t-k, -K, --report-kmer           Include distinct k-mers in reports, the default for streams not asking otherwise" << std::endl
               << "\t-z, -Z, --report-zero           Include zero count taxons in reports" << std::endl
               << "\t-t, -T, --translated-search     Use translated search when running classifications" << std::endl
-              << "\t-c, -C, --confidence [double]   Confidence score threshold (default: 0.0) (0 - 1)" << std::endl
-              << "\t-q, -Q, --min-quality [int]     Minimum base quality used in classification (default: 0), only effective with FASTQ input)." << std::endl
-              << "\t-g, -G, --hit-groups [int]      Minimum number of hit groups (overlapping k-mers sharing the same minimizer) needed to make a call (default: 2)" << std::endl
-              << "\t-o, -O, --memory-mapping        Avoids loading database into RAM" << std::endl;
+              << "\t-c, -C, --confidence [double]   Confidence score threshold (default: 0.0) (0 - 1), for streams not giving their own" << std::endl
+              << "\t-q, -Q, --min-quality [int]     Minimum base quality used in classification (default: 0), only effective with FASTQ input), for streams not giving their own." << std::endl
+              << "\t-g, -G, --hit-groups [int]      Minimum number of hit groups (overlapping k-mers sharing the same minimizer) needed to make a call (default: 2), for streams not giving their own" << std::endl
+              << "\t-o, -O, --memory-mapping        Avoids loading database into RAM" << std::endl
+              << "\t    --minimizer-cache [int]     Entries in each classification thread's cache of recent lookups, e.g. 16384 (default: 0, disabled)" << std::endl
+              << "\t    --chunk-length [int]        Reads longer than this are split and classified on several threads (default: 0, disabled)" << std::endl
+              << "\t    --batch-bases [int]         Target number of bases in each classification task (default: 1000000, 0 to classify client batches as sent)" << std::endl
+              << "\t    --io-threads [int]          Serve classification streams asynchronously on this many I/O threads (default: 0, a thread per stream)" << std::endl
+              << "\t    --stream-queued-bases [int] Stop reading from a stream with this many bases waiting to be classified (default: 100000000, 0 for no limit)" << std::endl
+              << "\t    --max-queued-bases [int]    Stop reading from all streams with this many bases waiting to be classified (default: 1000000000, 0 for no limit)" << std::endl
+              << "\t    --reorder-window [int]      Stop reading from a stream requesting ordered results with this many batches held back (default: 64, 0 for no limit)" << std::endl
+              << "\t    --response-compression [none|deflate|gzip]  Compress responses with this algorithm (default: none)" << std::endl
+              << "\t    --compression-level [none|low|medium|high]  Compress responses at this level with an algorithm the client accepts, overrides --response-compression" << std::endl
+              << "\t    --unix-socket [path]        Also listen on this unix domain socket, for clients on the same host" << std::endl
+              << "\t    --shared-memory             Allow clients on the same host to exchange sequences and results through shared memory" << std::endl
+              << "\t    --max-priority [int]        Highest priority a stream may ask for, a stream of priority p runs up to 2^p tasks each turn on the workers (default: 4, 0 - 16)" << std::endl;
     exit(exit_code);
 }
 
 
+// Options without a short form, values chosen outside of the char range
+enum LongOnlyOption {
+    OPT_MINIMIZER_CACHE = 256,
+    OPT_CHUNK_LENGTH,
+    OPT_BATCH_BASES,
+    OPT_IO_THREADS,
+    OPT_STREAM_QUEUED_BASES,
+    OPT_MAX_QUEUED_BASES,
+    OPT_REORDER_WINDOW,
+    OPT_RESPONSE_COMPRESSION,
+    OPT_COMPRESSION_LEVEL,
+    OPT_UNIX_SOCKET,
+    OPT_SHARED_MEMORY,
+    OPT_MAX_PRIORITY,
+};
+
+
+// Parse a count of bases, false if not a whole number within a uint64_t
+bool ParseBases(const char *arg, uint64_t &bases) {
+    char *end;
+    errno = 0;
+    // strtoull skips spaces and negates a leading minus rather than reject it
+    if (!isdigit((unsigned char)*arg)) {
+        return false;
+    }
+    bases = strtoull(arg, &end, 10);
+    return errno != ERANGE && *end == '\0';
+}
+
+
 void ParseCommandLine(int argc, char **argv, Options &opts) {
     // Define the long shell arguments
     struct option long_options[] = {
@@ -236,6 +914,18 @@ void ParseCommandLine(int argc, char **argv, Options &opts) {
         {"wait", required_argument, NULL, 'W'},
         {"help", no_argument, NULL, 'h'},
         {"help", no_argument, NULL, 'H'},
+        {"minimizer-cache", required_argument, NULL, OPT_MINIMIZER_CACHE},
+        {"chunk-length", required_argument, NULL, OPT_CHUNK_LENGTH},
+        {"batch-bases", required_argument, NULL, OPT_BATCH_BASES},
+        {"io-threads", required_argument, NULL, OPT_IO_THREADS},
+        {"stream-queued-bases", required_argument, NULL, OPT_STREAM_QUEUED_BASES},
+        {"max-queued-bases", required_argument, NULL, OPT_MAX_QUEUED_BASES},
+        {"reorder-window", required_argument, NULL, OPT_REORDER_WINDOW},
+        {"response-compression", required_argument, NULL, OPT_RESPONSE_COMPRESSION},
+        {"compression-level", required_argument, NULL, OPT_COMPRESSION_LEVEL},
+        {"unix-socket", required_argument, NULL, OPT_UNIX_SOCKET},
+        {"shared-memory", no_argument, NULL, OPT_SHARED_MEMORY},
+        {"max-priority", required_argument, NULL, OPT_MAX_PRIORITY},
         {NULL, 0, NULL, 0}
     };
     int opt;
@@ -332,6 +1022,94 @@ void ParseCommandLine(int argc, char **argv, Options &opts) {
             case 'w':
             case 'W':
                 opts.wait = atoi(optarg);
+                break;
+            case OPT_MINIMIZER_CACHE:
+                opts.minimizer_cache = atoi(optarg);
+                if (opts.minimizer_cache < 0) {
+                    std::cerr << "Minimizer cache size is not valid (>= 0)" << std::endl;
+                    exit(0);
+                }
+                break;
+            case OPT_CHUNK_LENGTH:
+                opts.chunk_length = atoi(optarg);
+                if (opts.chunk_length < 0) {
+                    std::cerr << "Chunk length is not valid (>= 0)" << std::endl;
+                    exit(0);
+                }
+                break;
+            case OPT_BATCH_BASES:
+                opts.batch_bases = atoi(optarg);
+                if (opts.batch_bases < 0) {
+                    std::cerr << "Batch bases is not valid (>= 0)" << std::endl;
+                    exit(0);
+                }
+                break;
+            case OPT_IO_THREADS:
+                opts.io_threads = atoi(optarg);
+                if (opts.io_threads < 0) {
+                    std::cerr << "I/O threads is not valid (>= 0)" << std::endl;
+                    exit(0);
+                }
+                break;
+            case OPT_STREAM_QUEUED_BASES:
+                if (!ParseBases(optarg, opts.stream_queued_bases)) {
+                    std::cerr << "Stream queued bases is not valid (>= 0)" << std::endl;
+                    exit(0);
+                }
+                break;
+            case OPT_MAX_QUEUED_BASES:
+                if (!ParseBases(optarg, opts.max_queued_bases)) {
+                    std::cerr << "Max queued bases is not valid (>= 0)" << std::endl;
+                    exit(0);
+                }
+                break;
+            case OPT_REORDER_WINDOW:
+                opts.reorder_window = atoi(optarg);
+                if (opts.reorder_window < 0) {
+                    std::cerr << "Reorder window is not valid (>= 0)" << std::endl;
+                    exit(0);
+                }
+                break;
+            case OPT_RESPONSE_COMPRESSION:
+                if (std::string(optarg) == "none")
+                    opts.response_compression = GRPC_COMPRESS_NONE;
+                else if (std::string(optarg) == "deflate")
+                    opts.response_compression = GRPC_COMPRESS_DEFLATE;
+                else if (std::string(optarg) == "gzip")
+                    opts.response_compression = GRPC_COMPRESS_GZIP;
+                else {
+                    std::cerr << "Response compression is not valid (none, deflate, gzip)" << std::endl;
+                    exit(0);
+                }
+                break;
+            case OPT_COMPRESSION_LEVEL:
+                opts.compression_level_set = true;
+                if (std::string(optarg) == "none")
+                    opts.compression_level = GRPC_COMPRESS_LEVEL_NONE;
+                else if (std::string(optarg) == "low")
+                    opts.compression_level = GRPC_COMPRESS_LEVEL_LOW;
+                else if (std::string(optarg) == "medium")
+                    opts.compression_level = GRPC_COMPRESS_LEVEL_MED;
+                else if (std::string(optarg) == "high")
+                    opts.compression_level = GRPC_COMPRESS_LEVEL_HIGH;
+                else {
+                    std::cerr << "Compression level is not valid (none, low, medium, high)" << std::endl;
+                    exit(0);
+                }
+                break;
+            case OPT_UNIX_SOCKET:
+                opts.unix_socket = optarg;
+                break;
+            case OPT_SHARED_MEMORY:
+                opts.shared_memory = true;
+                break;
+            case OPT_MAX_PRIORITY:
+                opts.max_priority = atoi(optarg);
+                if (opts.max_priority < 0 || opts.max_priority > 16) {
+                    std::cerr << "Max priority is not valid (0 - 16)" << std::endl;
+                    exit(0);
+                }
+                break;
         }
     }
     if (opts.db_path.empty()) {
@@ -22,9 +22,9 @@ namespace kraken2
     return clade_counts;
   }
 
-  taxon_counters_t GetCladeCounters(Taxonomy &tax, taxon_counters_t &call_counters)
+  taxon_counters_map_t GetCladeCounters(Taxonomy &tax, taxon_counters_map_t &call_counters)
   {
-    taxon_counters_t clade_counters;
+    taxon_counters_map_t clade_counters(call_counters.size() * 2);
 
     for (auto &kv_pair : call_counters)
     {
@@ -67,12 +67,12 @@ namespace kraken2
   // Depth-first search of taxonomy tree, reporting info at each node
   void KrakenReportDFS(uint32_t taxid, ostringstream &ss, bool report_zeros,
                        bool report_kmer_data,
-                       Taxonomy &taxonomy, taxon_counters_t &clade_counters,
-                       taxon_counters_t &call_counters, uint64_t total_seqs,
+                       Taxonomy &taxonomy, taxon_counters_map_t &clade_counters,
+                       taxon_counters_map_t &call_counters, uint64_t total_seqs,
                        char rank_code, int rank_depth, int depth)
   {
     // Clade count of 0 means all subtree nodes have clade count of 0
-    if (!report_zeros && clade_counters[taxid].readCount() == 0)
+    if (!report_zeros && clade_counters.get(taxid).readCount() == 0)
       return;
     TaxonomyNode node = taxonomy.nodes()[taxid];
     string rank = taxonomy.rank_data() + node.rank_offset;
@@ -129,7 +129,7 @@ namespace kraken2
     string name = taxonomy.name_data() + node.name_offset;
 
     PrintKrakenStyleReportLine(ss, report_kmer_data, total_seqs,
-                               clade_counters[taxid], call_counters[taxid], rank_str, node.external_id,
+                               clade_counters.get(taxid), call_counters.get(taxid), rank_str, node.external_id,
                                name, depth);
 
     auto child_count = node.child_count;
@@ -145,7 +145,7 @@ namespace kraken2
       std::sort(children.begin(), children.end(),
                 [&](const uint64_t &a, const uint64_t &b)
                 {
-                  return clade_counters[a].readCount() > clade_counters[b].readCount();
+                  return clade_counters.get(a).readCount() > clade_counters.get(b).readCount();
                 });
       for (auto child : children)
       {
@@ -157,10 +157,10 @@ namespace kraken2
   }
 
   void ReportKrakenStyle(ostringstream &ss, bool report_zeros, bool report_kmer_data,
-                         Taxonomy &taxonomy, taxon_counters_t &call_counters, uint64_t total_seqs,
+                         Taxonomy &taxonomy, taxon_counters_map_t &call_counters, uint64_t total_seqs,
                          uint64_t total_unclassified)
   {
-    taxon_counters_t clade_counters = GetCladeCounters(taxonomy, call_counters);
+    taxon_counters_map_t clade_counters = GetCladeCounters(taxonomy, call_counters);
 
     ss << "\% of Seqs"
        << "\t"
@@ -0,0 +1,79 @@
+#include <algorithm>
+
+#include "stream_scheduler.h"
+
+namespace {
+
+// Keeps the weight of the highest priority within an unsigned
+const int MAX_PRIORITY_SHIFT = 16;
+
+unsigned PriorityWeight(int priority) {
+    return 1u << std::clamp(priority, 0, MAX_PRIORITY_SHIFT);
+}
+
+}
+
+
+std::shared_ptr<StreamQueue> StreamScheduler::AddStream(int priority) {
+    auto queue = std::make_shared<StreamQueue>();
+    queue->weight = PriorityWeight(priority);
+    return queue;
+}
+
+
+void StreamScheduler::SetPriority(StreamQueue &queue, int priority) {
+    std::lock_guard<std::mutex> lock(mtx);
+    queue.weight = PriorityWeight(priority);
+}
+
+
+void StreamScheduler::Push(const std::shared_ptr<StreamQueue> &queue, std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(mtx);
+    queue->tasks.emplace_back(std::chrono::steady_clock::now(), std::move(task));
+    if (!queue->active) {
+        queue->active = true;
+        round.push_back(queue);
+    }
+}
+
+
+bool StreamScheduler::RunNext() {
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (round.empty()) {
+            return false;
+        }
+        std::shared_ptr<StreamQueue> queue = round.front();
+        if (queue->turns == 0) {
+            queue->turns = queue->weight;
+        }
+        auto waited = std::chrono::steady_clock::now() - queue->tasks.front().first;
+        uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(waited).count();
+        queue->waits.tasks++;
+        queue->waits.total_us += us;
+        queue->waits.peak_us = std::max(queue->waits.peak_us, us);
+        task = std::move(queue->tasks.front().second);
+        queue->tasks.pop_front();
+
+        // the turn passes once the stream has run its share or has nothing left
+        queue->turns--;
+        if (queue->tasks.empty()) {
+            queue->active = false;
+            queue->turns = 0;
+            round.pop_front();
+        }
+        else if (queue->turns == 0) {
+            round.pop_front();
+            round.push_back(std::move(queue));
+        }
+    }
+    task();
+    return true;
+}
+
+
+QueueWaits StreamScheduler::Waits(const StreamQueue &queue) {
+    std::lock_guard<std::mutex> lock(mtx);
+    return queue.waits;
+}
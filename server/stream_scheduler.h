@@ -0,0 +1,58 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+// Time tasks of a stream spent queued before a worker started them.
+struct QueueWaits {
+    uint64_t tasks = 0;
+    uint64_t total_us = 0;
+    uint64_t peak_us = 0;
+};
+
+// Tasks of one stream waiting for a worker, in the order received.
+struct StreamQueue {
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    unsigned weight = 1;
+    std::deque<std::pair<time_point, std::function<void()>>> tasks;
+    // tasks left in the stream's current turn
+    unsigned turns = 0;
+    // has tasks, so is in the round robin
+    bool active = false;
+    QueueWaits waits;
+};
+
+// Shares the classification workers between streams. Each stream queues its
+// tasks separately and streams with tasks take turns, a stream of priority p
+// running up to 2^p tasks a turn. A small urgent stream then waits only for
+// a worker to free up, not for the backlog of bulk streams ahead of it.
+//
+// The scheduler has no threads of its own: each task pushed is matched by
+// one call to RunNext on the pool, which picks the task to run at that point.
+class StreamScheduler {
+public:
+    // A queue for a new stream
+    std::shared_ptr<StreamQueue> AddStream(int priority = 0);
+
+    // Change the priority of a stream, taking effect from its next turn
+    void SetPriority(StreamQueue &queue, int priority);
+
+    // Queue a task of a stream, RunNext must then be called once
+    void Push(const std::shared_ptr<StreamQueue> &queue, std::function<void()> task);
+
+    // Run the next task in turn, returns false if none was queued
+    bool RunNext();
+
+    // Waits of the tasks of a stream started so far
+    QueueWaits Waits(const StreamQueue &queue);
+
+private:
+    std::mutex mtx;
+    // streams with queued tasks, the front one is taking its turn
+    std::deque<std::shared_ptr<StreamQueue>> round;
+};
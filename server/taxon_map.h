@@ -0,0 +1,162 @@
+#ifndef KRAKEN2_TAXON_MAP_H_
+#define KRAKEN2_TAXON_MAP_H_
+
+#include "kraken2_headers.h"
+#include "kraken2_data.h"
+#include "readcounts.h"
+
+namespace kraken2
+{
+    // Open-addressed (linear probing) map keyed by taxon, a replacement for
+    // the node based taxon_counts_t/taxon_counters_t on hot paths. The slot
+    // array is kept on clear(), so a map reused for every read or batch stops
+    // allocating it once it has grown to its working set.
+    //
+    // Unlike std::unordered_map, inserting may move existing entries, so
+    // references and iterators are invalidated by operator[].
+    template <typename V>
+    class TaxonMap
+    {
+    public:
+        typedef std::pair<taxid_t, V> value_type;
+
+        class iterator
+        {
+        public:
+            iterator(value_type *slot, value_type *end) : slot_(slot), end_(end) { Skip(); }
+            value_type &operator*() const { return *slot_; }
+            value_type *operator->() const { return slot_; }
+            iterator &operator++()
+            {
+                ++slot_;
+                Skip();
+                return *this;
+            }
+            bool operator==(const iterator &other) const { return slot_ == other.slot_; }
+            bool operator!=(const iterator &other) const { return slot_ != other.slot_; }
+
+        private:
+            value_type *slot_;
+            value_type *end_;
+            void Skip()
+            {
+                while (slot_ != end_ && slot_->first == EMPTY)
+                    ++slot_;
+            }
+        };
+
+        // Sized for the few dozen distinct taxa typical of a read
+        explicit TaxonMap(size_t capacity = 64) { Allocate(capacity); }
+
+        V &operator[](taxid_t key)
+        {
+            if ((size_ + 1) * 4 > slots_.size() * 3)
+                Grow();
+            size_t idx = Slot(key);
+            while (slots_[idx].first != key)
+            {
+                if (slots_[idx].first == EMPTY)
+                {
+                    slots_[idx].first = key;
+                    slots_[idx].second = V();
+                    size_++;
+                    break;
+                }
+                idx = (idx + 1) & mask_;
+            }
+            return slots_[idx].second;
+        }
+
+        iterator find(taxid_t key)
+        {
+            size_t idx = Slot(key);
+            while (slots_[idx].first != EMPTY)
+            {
+                if (slots_[idx].first == key)
+                    return iterator(&slots_[idx], slots_.data() + slots_.size());
+                idx = (idx + 1) & mask_;
+            }
+            return end();
+        }
+
+        // Value for key without inserting it, a default value if absent
+        const V &get(taxid_t key) const
+        {
+            static const V absent{};
+            size_t idx = Slot(key);
+            while (slots_[idx].first != EMPTY)
+            {
+                if (slots_[idx].first == key)
+                    return slots_[idx].second;
+                idx = (idx + 1) & mask_;
+            }
+            return absent;
+        }
+
+        iterator begin() { return iterator(slots_.data(), slots_.data() + slots_.size()); }
+        iterator end() { return iterator(slots_.data() + slots_.size(), slots_.data() + slots_.size()); }
+
+        size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+
+        // Keeps the slots, values are overwritten when their slot is reused
+        void clear()
+        {
+            if (size_ == 0)
+                return;
+            // values are reset too, so counters do not keep their sketches
+            // alive in a map that is kept around
+            for (auto &slot : slots_)
+            {
+                if (slot.first != EMPTY)
+                {
+                    slot.first = EMPTY;
+                    slot.second = V();
+                }
+            }
+            size_ = 0;
+        }
+
+    private:
+        // Never a key: TAXID_MAX is only used as the mate pair border marker
+        static const taxid_t EMPTY = TAXID_MAX;
+
+        vector<value_type> slots_;
+        size_t size_ = 0;
+        size_t mask_ = 0;
+        int shift_ = 0;
+
+        // Fibonacci hashing, taxon ids are small and dense
+        size_t Slot(taxid_t key) const { return (key * 0x9E3779B97F4A7C15ULL) >> shift_; }
+
+        void Allocate(size_t capacity)
+        {
+            size_t slots = 8;
+            shift_ = 61;
+            while (slots < capacity)
+            {
+                slots <<= 1;
+                shift_--;
+            }
+            slots_.assign(slots, value_type(EMPTY, V()));
+            mask_ = slots - 1;
+            size_ = 0;
+        }
+
+        void Grow()
+        {
+            vector<value_type> old;
+            old.swap(slots_);
+            Allocate(old.size() * 2);
+            for (auto &slot : old)
+            {
+                if (slot.first != EMPTY)
+                    (*this)[slot.first] = std::move(slot.second);
+            }
+        }
+    };
+
+    typedef TaxonMap<uint64_t> taxon_counts_map_t;
+    typedef TaxonMap<READCOUNTER> taxon_counters_map_t;
+}
+#endif
@@ -0,0 +1,38 @@
+#include "taxonomy_index.h"
+
+namespace kraken2
+{
+
+    void TaxonomyIndex::Build(Taxonomy &taxonomy)
+    {
+        auto node_count = taxonomy.node_count();
+        pre_order_.assign(node_count, 0);
+        subtree_end_.assign(node_count, 0);
+        if (node_count < 2)
+            return;
+
+        // Iterative DFS from the root (node 1), children of a node are stored
+        // contiguously from first_child.
+        auto nodes = taxonomy.nodes();
+        vector<std::pair<taxid_t, uint64_t>> stack;
+        uint64_t position = 0;
+        pre_order_[1] = position++;
+        stack.emplace_back(1, 0);
+        while (!stack.empty())
+        {
+            auto &top = stack.back();
+            auto &node = nodes[top.first];
+            if (top.second < node.child_count)
+            {
+                taxid_t child = node.first_child + top.second++;
+                pre_order_[child] = position++;
+                stack.emplace_back(child, 0);
+            }
+            else
+            {
+                subtree_end_[top.first] = position;
+                stack.pop_back();
+            }
+        }
+    }
+}
@@ -0,0 +1,119 @@
+#ifndef KRAKEN2_TAXONOMY_INDEX_H_
+#define KRAKEN2_TAXONOMY_INDEX_H_
+
+#include <algorithm>
+
+#include "kraken2_headers.h"
+#include "taxonomy.h"
+#include "kraken2_data.h"
+
+namespace kraken2
+{
+    // A taxon hit by a read, ordered by position in the taxonomy pre-order.
+    struct TaxonHit
+    {
+        uint64_t pre_order;
+        taxid_t taxon;
+        uint32_t count;
+        uint32_t score;   // hits on the taxon's root-to-leaf path
+    };
+
+    // Pre-order numbering of the taxonomy. The descendants of a node occupy
+    // the positions directly after it up to the end of its subtree, so an
+    // ancestry test becomes an interval check rather than a walk up the tree.
+    class TaxonomyIndex
+    {
+    public:
+        void Build(Taxonomy &taxonomy);
+
+        uint64_t PreOrder(taxid_t taxon) const { return pre_order_[taxon]; }
+        uint64_t SubtreeEnd(taxid_t taxon) const { return subtree_end_[taxon]; }
+
+        // Same semantics as Taxonomy::IsAAncestorOfB, a node is its own ancestor
+        bool IsAAncestorOfB(taxid_t a, taxid_t b) const
+        {
+            if (!a || !b)
+                return false;
+            if (a == b)
+                return true;
+            return pre_order_[a] <= pre_order_[b] && pre_order_[b] < subtree_end_[a];
+        }
+
+        // The call for a read's hit counts, as ResolveTree in Kraken 2's
+        // classify.cc. The hits and path are scratch space kept by the caller.
+        template <typename Counts>
+        taxid_t ResolveTree(Taxonomy &taxonomy, Counts &hit_counts, uint32_t required_score,
+                            vector<TaxonHit> &hits, vector<size_t> &path) const;
+
+    private:
+        vector<uint64_t> pre_order_;
+        vector<uint64_t> subtree_end_;
+    };
+
+    template <typename Counts>
+    taxid_t TaxonomyIndex::ResolveTree(Taxonomy &taxonomy, Counts &hit_counts, uint32_t required_score,
+                                       vector<TaxonHit> &hits, vector<size_t> &path) const
+    {
+        taxid_t max_taxon = 0;
+        uint32_t max_score = 0;
+
+        hits.clear();
+        for (auto &kv_pair : hit_counts)
+        {
+            hits.push_back({PreOrder(kv_pair.first), kv_pair.first, (uint32_t)kv_pair.second, 0});
+        }
+        std::sort(hits.begin(), hits.end(),
+                  [](const TaxonHit &a, const TaxonHit &b) { return a.pre_order < b.pre_order; });
+
+        // Sum each taxon's LTR path, find taxon with highest LTR score. In
+        // pre-order the hit ancestors of a taxon are exactly those left on the
+        // path stack, and the nearest one already holds the sum of the others.
+        // Ties are resolved by LCA, which does not depend on visiting order.
+        path.clear();
+        for (size_t i = 0; i < hits.size(); i++)
+        {
+            auto &hit = hits[i];
+            while (!path.empty() && !IsAAncestorOfB(hits[path.back()].taxon, hit.taxon))
+                path.pop_back();
+            hit.score = hit.count + (path.empty() ? 0 : hits[path.back()].score);
+            path.push_back(i);
+
+            if (hit.score > max_score)
+            {
+                max_score = hit.score;
+                max_taxon = hit.taxon;
+            }
+            else if (hit.score == max_score)
+            {
+                max_taxon = taxonomy.LowestCommonAncestor(max_taxon, hit.taxon);
+            }
+        }
+
+        // Reset max. score to be only hits at the called taxon
+        auto max_hit = hit_counts.find(max_taxon);
+        max_score = max_hit == hit_counts.end() ? 0 : max_hit->second;
+        // We probably have a call w/o required support (unless LCA resolved tie)
+        while (max_taxon && max_score < required_score)
+        {
+            // Hits in max_taxon's clade are contiguous in pre-order
+            auto first = std::lower_bound(
+                hits.begin(), hits.end(), PreOrder(max_taxon),
+                [](const TaxonHit &hit, uint64_t pos) { return hit.pre_order < pos; });
+            auto clade_end = SubtreeEnd(max_taxon);
+            max_score = 0;
+            for (auto it = first; it != hits.end() && it->pre_order < clade_end; ++it)
+                max_score += it->count;
+            // Score is now sum of hits at max_taxon and w/in max_taxon clade
+            if (max_score >= required_score)
+                // Kill loop and return, we've got enough support here
+                return max_taxon;
+            else
+                // Run up tree until confidence threshold is met
+                // Run off tree if required score isn't met
+                max_taxon = taxonomy.nodes()[max_taxon].parent_id;
+        }
+
+        return max_taxon;
+    }
+}
+#endif
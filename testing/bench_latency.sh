@@ -0,0 +1,32 @@
+#!/bin/bash
+
+# Compare the latency of small requests sent as unary Classify calls and as
+# a ClassifyStream each.
+#
+#./bench_latency.sh 8 8081 reads.fastq.gz db 1000 10
+#
+# A server is started and the client times the given number of requests, each
+# of the given number of sequences from the start of the input, printing the
+# p50 and p99 latencies of each path. Extra options can be given with
+# SERVER_ARGS and CLIENT_ARGS.
+
+threads=$1
+port=$2
+input=$3
+db=$4
+requests=${5:-1000}
+reads=${6:-10}
+
+PATH=$PATH:../build/client:../build/server
+
+kraken2_server --db $db --host-ip 127.0.0.1 --port $port --thread-pool ${threads} ${SERVER_ARGS} 2> /dev/null > /dev/null &
+# wait for the database to load
+until kraken2_client --taxonomy /dev/null --port $port --host-ip 127.0.0.1 2> /dev/null; do
+    sleep 1
+done
+
+kraken2_client --sequence $input --port $port --host-ip 127.0.0.1 \
+    --latency $requests --latency-reads $reads ${CLIENT_ARGS} 2> /dev/null
+
+kraken2_client --port $port --host-ip 127.0.0.1 --shutdown 2> /dev/null
+wait
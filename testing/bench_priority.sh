@@ -0,0 +1,48 @@
+#!/bin/bash
+
+# Time small requests while a bulk stream keeps the server busy, at the
+# default priority and at a raised one.
+#
+#./bench_priority.sh 8 8081 bulk.fastq.gz reads.fastq.gz db 100 10 4
+#
+# The bulk file is classified by one client while another times the given
+# number of requests of the given number of sequences from the start of the
+# second file, first at priority 0 then at the given priority. The p50 and
+# p99 latencies of each are printed, followed by the queue waits the server
+# logged for each stream. Extra options can be given with SERVER_ARGS and
+# CLIENT_ARGS.
+
+threads=$1
+port=$2
+bulk=$3
+input=$4
+db=$5
+requests=${6:-100}
+reads=${7:-10}
+priority=${8:-4}
+
+PATH=$PATH:../build/client:../build/server
+
+log=$(mktemp)
+kraken2_server --db $db --host-ip 127.0.0.1 --port $port --thread-pool ${threads} ${SERVER_ARGS} 2> $log > /dev/null &
+# wait for the database to load
+until kraken2_client --taxonomy /dev/null --port $port --host-ip 127.0.0.1 2> /dev/null; do
+    sleep 1
+done
+
+kraken2_client --sequence $bulk --port $port --host-ip 127.0.0.1 ${CLIENT_ARGS} > /dev/null 2> /dev/null &
+bulk_pid=$!
+# let the bulk stream fill the queue
+sleep 5
+
+for p in 0 $priority; do
+    echo "[priority ${p}]"
+    kraken2_client --sequence $input --port $port --host-ip 127.0.0.1 --priority $p \
+        --latency $requests --latency-reads $reads ${CLIENT_ARGS} 2> /dev/null
+done
+
+wait $bulk_pid
+kraken2_client --port $port --host-ip 127.0.0.1 --shutdown 2> /dev/null
+wait
+grep "waited" $log
+rm $log
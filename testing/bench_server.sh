@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# Compare server throughput across sets of server options.
+#
+#./bench_server.sh 8 8081 reads.fastq.gz db "" "--minimizer-cache 16384"
+#
+# Each quoted argument after the database is one server configuration. A fresh
+# server is started for each and a single client run against it; the Mbp/m
+# reported by the server for the stream is printed along with the bytes the
+# client received. Extra client options can be given with CLIENT_ARGS, e.g.
+#
+#CLIENT_ARGS="--hitlist none" ./bench_server.sh 8 8081 reads.fastq.gz db ""
+#
+# Running it again with CLIENT_ARGS="--ordered" gives the cost of returning
+# results in input order, and the peak number of batches held back for it.
+#
+# Bytes crossing the loopback interface and the CPU time of server and client
+# are printed too, so compression can be weighed against bandwidth, e.g.
+#
+#CLIENT_ARGS="--request-compression gzip" ./bench_server.sh 8 8081 reads.fastq.gz db "" "--compression-level high"
+
+threads=$1
+port=$2
+input=$3
+db=$4
+shift 4
+
+PATH=$PATH:../build/client:../build/server
+
+# bytes received on the loopback interface, each byte sent is also received
+lo_bytes() {
+    awk '$1 == "lo:" {print $2}' /proc/net/dev
+}
+
+# user + system CPU seconds of a process
+cpu_seconds() {
+    awk -v hz=$(getconf CLK_TCK) '{printf "%.2f", ($14 + $15) / hz}' /proc/$1/stat
+}
+
+for server_args in "$@"; do
+    log=$(mktemp)
+    client_log=$(mktemp)
+    kraken2_server --db $db --host-ip 127.0.0.1 --port $port --thread-pool ${threads} ${server_args} 2> $log > /dev/null &
+    server_pid=$!
+    # wait for the database to load, so its CPU time is not counted
+    until kraken2_client --taxonomy /dev/null --port $port --host-ip 127.0.0.1 2> /dev/null; do
+        sleep 1
+    done
+    server_cpu=$(cpu_seconds $server_pid)
+    wire=$(lo_bytes)
+    kraken2_client --sequence $input --port $port --host-ip 127.0.0.1 ${CLIENT_ARGS} > /dev/null 2> $client_log
+    wire=$(( $(lo_bytes) - wire ))
+    server_cpu=$(awk -v a=$server_cpu -v b=$(cpu_seconds $server_pid) 'BEGIN {printf "%.2f", b - a}')
+    kraken2_client --port $port --shutdown 2> /dev/null
+    wait
+    echo "[${server_args}] [${CLIENT_ARGS}] $(grep 'Mbp/m' $log)"
+    echo "    $(grep 'Request bytes' $client_log), $(grep 'Response bytes' $client_log), Wire bytes: ${wire}"
+    echo "    Server CPU seconds: ${server_cpu}, Client $(grep 'CPU seconds' $client_log)"
+    # only streams asking for ordered results log how many batches waited
+    grep 'batches held back' $log | sed 's/^\s*/    /'
+    rm $log $client_log
+done
@@ -0,0 +1,57 @@
+#!/bin/bash
+
+# Compare transports between a client and a server on the same host.
+#
+#./bench_transport.sh 8 8081 reads.fastq.gz db
+#
+# One server is started listening on loopback TCP and a unix domain socket,
+# with shared memory streams enabled. The same input is classified over each
+# transport in turn; the client wall time, the Mbp/m reported by the server
+# for the stream and the CPU time of server and client are printed. Extra
+# options for all runs can be given with SERVER_ARGS and CLIENT_ARGS, and the
+# size of each shared memory ring in MB with RING_MB (default 256).
+
+threads=$1
+port=$2
+input=$3
+db=$4
+socket=$(mktemp -u /tmp/kraken2.XXXXXX.sock)
+ring_mb=${RING_MB:-256}
+
+PATH=$PATH:../build/client:../build/server
+
+# user + system CPU seconds of a process
+cpu_seconds() {
+    awk -v hz=$(getconf CLK_TCK) '{printf "%.2f", ($14 + $15) / hz}' /proc/$1/stat
+}
+
+log=$(mktemp)
+kraken2_server --db $db --host-ip 127.0.0.1 --port $port --thread-pool ${threads} \
+    --unix-socket $socket --shared-memory ${SERVER_ARGS} 2> $log > /dev/null &
+server_pid=$!
+# wait for the database to load, so its CPU time is not counted
+until kraken2_client --taxonomy /dev/null --port $port --host-ip 127.0.0.1 2> /dev/null; do
+    sleep 1
+done
+
+run() {
+    name=$1
+    shift
+    client_log=$(mktemp)
+    server_cpu=$(cpu_seconds $server_pid)
+    start=$(date +%s.%N)
+    kraken2_client --sequence $input "$@" ${CLIENT_ARGS} > /dev/null 2> $client_log
+    end=$(date +%s.%N)
+    server_cpu=$(awk -v a=$server_cpu -v b=$(cpu_seconds $server_pid) 'BEGIN {printf "%.2f", b - a}')
+    echo "[${name}] Client seconds: $(awk -v a=$start -v b=$end 'BEGIN {printf "%.2f", b - a}'), $(grep 'Mbp/m' $log | tail -n 1)"
+    echo "    Server CPU seconds: ${server_cpu}, Client $(grep 'CPU seconds' $client_log)"
+    rm $client_log
+}
+
+run "tcp" --port $port --host-ip 127.0.0.1
+run "unix socket" --unix-socket $socket
+run "shared memory" --unix-socket $socket --shared-memory $ring_mb
+
+kraken2_client --port $port --host-ip 127.0.0.1 --shutdown 2> /dev/null
+wait
+rm -f $log $socket
@@ -0,0 +1,152 @@
+// Checks TaxonomyIndex::ResolveTree, the pre-order scoring used by the server,
+// against the nested loop of ResolveTree in Kraken 2's classify.cc on random
+// taxonomies and random hit counts, for several confidence thresholds.
+//
+//resolve_tree_check [trials] [seed]
+//
+// Each trial writes a random nodes.dmp and names.dmp, converts them with
+// Kraken 2's NCBITaxonomy as kraken2-build does and loads the result, so the
+// taxonomy has the same layout as that of a real database. Built with
+// cmake -DBUILD_CHECKS=ON, exits non-zero if any call differs.
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unistd.h>
+
+#include "kraken2_data.h"
+#include "taxonomy.h"
+#include "taxon_map.h"
+#include "taxonomy_index.h"
+
+using namespace kraken2;
+
+
+// ResolveTree of Kraken 2's classify.cc, as the server ran it before the index
+taxid_t NestedResolveTree(taxon_counts_t &hit_counts, Taxonomy &taxonomy, uint32_t required_score) {
+    taxid_t max_taxon = 0;
+    uint32_t max_score = 0;
+
+    for (auto &kv_pair : hit_counts) {
+        taxid_t taxon = kv_pair.first;
+        uint32_t score = 0;
+        for (auto &kv_pair2 : hit_counts) {
+            taxid_t taxon2 = kv_pair2.first;
+            if (taxonomy.IsAAncestorOfB(taxon2, taxon)) {
+                score += kv_pair2.second;
+            }
+        }
+        if (score > max_score) {
+            max_score = score;
+            max_taxon = taxon;
+        }
+        else if (score == max_score) {
+            max_taxon = taxonomy.LowestCommonAncestor(max_taxon, taxon);
+        }
+    }
+
+    max_score = hit_counts[max_taxon];
+    while (max_taxon && max_score < required_score) {
+        max_score = 0;
+        for (auto &kv_pair : hit_counts) {
+            if (taxonomy.IsAAncestorOfB(max_taxon, kv_pair.first)) {
+                max_score += kv_pair.second;
+            }
+        }
+        if (max_score >= required_score)
+            return max_taxon;
+        else
+            max_taxon = taxonomy.nodes()[max_taxon].parent_id;
+    }
+    return max_taxon;
+}
+
+
+// Write a random tree of n nodes as NCBI dump files and convert it to a Kraken 2 taxonomy
+void WriteTaxonomy(const std::string &dir, int n, std::mt19937 &rng) {
+    std::ofstream nodes(dir + "/nodes.dmp");
+    std::ofstream names(dir + "/names.dmp");
+    // a small reach makes deep narrow trees, a large one shallow bushy trees
+    int reach = 1 + rng() % n;
+    for (int id = 1; id <= n; ++id) {
+        int parent = id == 1 ? 1 : std::max(1, id - 1 - (int)(rng() % reach));
+        nodes << id << "\t|\t" << parent << "\t|\tno rank\t|\n";
+        names << id << "\t|\ttaxon " << id << "\t|\t\t|\tscientific name\t|\n";
+    }
+    nodes.close();
+    names.close();
+
+    NCBITaxonomy ncbi(dir + "/nodes.dmp", dir + "/names.dmp");
+    for (int id = 1; id <= n; ++id) {
+        ncbi.MarkNode(id);
+    }
+    ncbi.ConvertToKrakenTaxonomy((dir + "/taxo.k2d").c_str());
+}
+
+
+int main(int argc, char **argv) {
+    int trials = argc > 1 ? atoi(argv[1]) : 200;
+    int seed = argc > 2 ? atoi(argv[2]) : 1;
+    std::mt19937 rng(seed);
+
+    char dir_template[] = "/tmp/resolve_tree_check.XXXXXX";
+    if (mkdtemp(dir_template) == nullptr) {
+        std::cerr << "Could not create a temporary directory" << std::endl;
+        return 1;
+    }
+    std::string dir(dir_template);
+
+    uint64_t reads = 0;
+    uint64_t mismatches = 0;
+    vector<TaxonHit> hits;
+    vector<size_t> path;
+    for (int trial = 0; trial < trials; ++trial) {
+        WriteTaxonomy(dir, 2 + rng() % 500, rng);
+        Taxonomy taxonomy(dir + "/taxo.k2d");
+        TaxonomyIndex index;
+        index.Build(taxonomy);
+        taxid_t max_id = taxonomy.node_count() - 1;
+
+        for (int read = 0; read < 100; ++read) {
+            // as the server's hit_counts, and the same counts in Kraken 2's map
+            taxon_counts_map_t counts_map;
+            taxon_counts_t counts;
+            size_t total_minimizers = 0;
+            int distinct = 1 + rng() % 40;
+            for (int i = 0; i < distinct; ++i) {
+                taxid_t taxon = 1 + rng() % max_id;
+                uint32_t count = 1 + rng() % 5;
+                counts_map[taxon] += count;
+                counts[taxon] += count;
+                total_minimizers += count;
+            }
+            total_minimizers += rng() % 100;
+            for (double confidence : {0.0, 0.1, 0.25, 0.5, 0.9}) {
+                uint32_t required_score = ceil(confidence * total_minimizers);
+                taxon_counts_t nested_counts = counts;
+                taxid_t expected = NestedResolveTree(nested_counts, taxonomy, required_score);
+                taxid_t call = index.ResolveTree(taxonomy, counts_map, required_score, hits, path);
+                reads++;
+                if (call != expected) {
+                    if (mismatches++ < 10) {
+                        std::cerr << "Trial " << trial << " read " << read << " confidence " << confidence
+                                  << ": called " << call << ", expected " << expected << std::endl;
+                    }
+                }
+            }
+        }
+    }
+
+    unlink((dir + "/nodes.dmp").c_str());
+    unlink((dir + "/names.dmp").c_str());
+    unlink((dir + "/taxo.k2d").c_str());
+    rmdir(dir.c_str());
+
+    std::cout << trials << " taxonomies, " << reads << " calls, "
+              << mismatches << " differing from the nested loop" << std::endl;
+    return mismatches == 0 ? 0 : 1;
+}
@@ -1,6 +1,12 @@
 #!/bin/bash
 
 #./run_server.sh 2 8081 4 100times.reads.fastq.gz
+#
+# Extra server options can be given with SERVER_ARGS, e.g.
+#SERVER_ARGS="--io-threads 4" ./run_server.sh 64 8081 16 100times.reads.fastq.gz
+#
+# The last line gives the bases classified by all clients over the time until
+# the last of them finished, as in the multi client table of the README.
 
 threads=$1
 port=$2
@@ -47,7 +53,7 @@ kraken2_client --port $port --host-ip 127.0.0.1
 
 echo ""
 echo " +++ Starting server +++"
-kraken2_server --db $db --host-ip 127.0.0.1 --port $port --wait 2 --thread-pool ${threads} &
+kraken2_server --db $db --host-ip 127.0.0.1 --port $port --wait 2 --thread-pool ${threads} ${SERVER_ARGS} &
 sleep 5  # give database time to load
 
 echo ""
@@ -64,11 +70,20 @@ function run() {
 }
 export -f run
 
+start=$(date +%s.%N)
 printf %s\\n $(seq $nclients) | xargs -n 1 -P $nclients -I {} bash -c "run $input $port {}"
+elapsed=$(awk -v a=$start -v b=$(date +%s.%N) 'BEGIN {printf "%.2f", b - a}')
 
 echo ""
 echo " +++ Final server stats +++"
-kraken2_client --port $port --host-ip 127.0.0.1 | grep sequences 
+kraken2_client --port $port --host-ip 127.0.0.1 > summary.txt
+grep sequences summary.txt
+
+# a row of the multi client table, bases of all clients over the time until the last finished
+mbp=$(grep "^[0-9][0-9]* sequences (.* Mbp) processed\.$" summary.txt | sed 's/.*(\(.*\) Mbp).*/\1/')
+echo "${nclients} clients, ${threads} server threads [${SERVER_ARGS}]: ${mbp} Mbp in ${elapsed}s," \
+    $(awk -v m=$mbp -v s=$elapsed 'BEGIN {printf "%.0f", m / s * 60}') "Mbp/m"
+rm summary.txt
 
 echo ""
 echo " +++ Shutting down server +++ "
@@ -0,0 +1,99 @@
+#!/bin/bash
+
+# Poll the server summary from many clients while many streams finish.
+#
+#./stress_summary.sh 8 8081 reads.fastq.gz db 16 16 10
+#
+# The given number of clients each classify the input the given number of
+# times in turn while as many pollers request the summary in a loop. A poll
+# fails if its summary is cut short or has fewer sequences than the same
+# poller saw before. Once the streams are done the total sequences in the
+# final summary must equal the sum of those the server logged for each
+# stream. Exits non-zero on any failure. Extra options can be
+# given with SERVER_ARGS and CLIENT_ARGS.
+
+threads=$1
+port=$2
+input=$3
+db=$4
+streams=${5:-16}
+pollers=${6:-16}
+rounds=${7:-10}
+
+PATH=$PATH:../build/client:../build/server
+
+work=$(mktemp -d)
+kraken2_server --db $db --host-ip 127.0.0.1 --port $port --thread-pool ${threads} ${SERVER_ARGS} 2> $work/server.log > /dev/null &
+# wait for the database to load
+until kraken2_client --taxonomy /dev/null --port $port --host-ip 127.0.0.1 2> /dev/null; do
+    sleep 1
+done
+
+# a whole summary ends with the totals, the last of which is always there
+complete() {
+    grep -q "^[0-9][0-9]* sequences (.* Mbp) processed\.$" $1 && grep -q "batches of cancelled streams dropped\.$" $1
+}
+
+# total sequences of a summary
+processed() {
+    grep -o "^[0-9][0-9]* sequences (.* Mbp) processed\.$" $1 | awk '{print $1}'
+}
+
+# Snapshots are published in order, so the totals a poller sees never go down
+poll() {
+    polls=0
+    failed=0
+    regressed=0
+    last=0
+    while [ ! -e $work/done ]; do
+        if ! kraken2_client --port $port --host-ip 127.0.0.1 > $work/poll.$1 2> /dev/null \
+                || ! complete $work/poll.$1; then
+            failed=$((failed + 1))
+        else
+            current=$(processed $work/poll.$1)
+            [ "$current" -lt "$last" ] && regressed=$((regressed + 1))
+            last=$current
+        fi
+        polls=$((polls + 1))
+    done
+    echo "$polls $failed $regressed" > $work/polls.$1
+}
+
+classify() {
+    for round in $(seq $rounds); do
+        kraken2_client --sequence $input --port $port --host-ip 127.0.0.1 ${CLIENT_ARGS} > /dev/null 2> /dev/null \
+            || echo "stream $1 round $round failed"
+    done
+}
+
+poller_pids=()
+for i in $(seq $pollers); do
+    poll $i &
+    poller_pids+=($!)
+done
+stream_pids=()
+for i in $(seq $streams); do
+    classify $i > $work/streams.$i &
+    stream_pids+=($!)
+done
+wait ${stream_pids[@]}
+touch $work/done
+wait ${poller_pids[@]}
+
+kraken2_client --port $port --host-ip 127.0.0.1 > $work/final 2> /dev/null
+kraken2_client --port $port --host-ip 127.0.0.1 --shutdown 2> /dev/null
+wait
+
+status=0
+cat $work/streams.* | grep . && status=1
+read polls failed regressed <<< $(cat $work/polls.* | awk '{p += $1; f += $2; r += $3} END {print p, f, r}')
+echo "${polls} summary polls, ${failed} incomplete or failed, ${regressed} with fewer sequences than the poll before"
+[ "$failed" -eq 0 ] && [ "$regressed" -eq 0 ] || status=1
+
+logged=$(grep -o "^[0-9]* sequences (.* Mbp) processed in" $work/server.log | awk '{n += $1} END {print n + 0}')
+total=$(processed $work/final)
+echo "${logged} sequences logged by ${streams}x${rounds} streams, ${total} in the final summary"
+[ "$logged" = "$total" ] || status=1
+
+rm -r $work
+exit $status
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+
+#include "Kraken2.grpc.pb.h"
+
+// Pack a sequence into 2 bits per base, non-ACGT runs are recorded as ambiguous
+void PackSequence(
+    const char *seq, size_t length, kraken2proto::Kraken2PackedSequence &packed);
+
+// Record bases with a quality below the threshold in the low quality mask
+void PackQualityMask(
+    const char *quals, size_t length, int minimum_quality_score,
+    kraken2proto::Kraken2PackedSequence &packed);
+
+// Decode a packed sequence into seq, reusing its storage
+void UnpackSequence(const kraken2proto::Kraken2PackedSequence &packed, std::string &seq);
+
+// Number of bases in a request, in either encoding
+size_t SequenceLength(const kraken2proto::Kraken2SequenceRequest &req);
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <google/protobuf/message_lite.h>
+
+// Returns true once the other side of a ring is known to be gone, checked
+// while waiting
+typedef std::function<bool()> CancelledCheck;
+
+// Positions in one ring, shared between processes. Positions only grow, the
+// producer advances head once a message is complete and the consumer tail
+// once it has been parsed.
+struct SharedRingHeader {
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    // set by the producer after its last message
+    std::atomic<uint32_t> closed;
+    // written by the creator, each side reads it once when mapping the
+    // segment and keeps its own copy
+    uint64_t capacity;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "shared rings need address free atomics");
+
+// A single producer, single consumer ring of length prefixed protobuf
+// messages. Messages are serialized into and parsed from the ring directly
+// unless they wrap around its end.
+class SharedRing {
+public:
+    // capacity is the size of the ring at data, already checked against the mapping
+    SharedRing(SharedRingHeader *header, char *data, uint64_t capacity)
+    : header(header), data(data), capacity(capacity) {}
+
+    // Wait for space and append a message, returns false if it can never fit
+    // or the consumer is gone
+    bool Write(const google::protobuf::MessageLite &msg, const CancelledCheck &cancelled);
+
+    // Wait for the next message, returns false once the ring is closed and
+    // drained, the consumer is gone or the message does not parse
+    bool Read(google::protobuf::MessageLite *msg, const CancelledCheck &cancelled);
+
+    // Wait for the next message and give its size without consuming it
+    bool NextMessageSize(uint32_t *size, const CancelledCheck &cancelled);
+
+    // No more messages will be written
+    void Close();
+
+    // Largest message Write accepts
+    uint64_t MaxMessageSize() const;
+
+private:
+    SharedRingHeader *header;
+    char *data;
+    // not read from the header again, the other process could change it
+    uint64_t capacity;
+    // messages wrapping around the end of the ring
+    std::string scratch;
+
+    void CopyIn(uint64_t pos, const void *src, uint64_t n);
+    void CopyOut(uint64_t pos, void *dst, uint64_t n) const;
+    bool WaitForMessage(uint64_t tail, const CancelledCheck &cancelled);
+};
+
+// A shared memory segment holding a ring of requests from a client and a
+// ring of results back. The client creates it and names it in a
+// ClassifySharedMemory call, the server opens it by that name.
+class SharedMemorySegment {
+public:
+    // Create a segment with rings of capacity bytes each, throws on failure
+    static std::unique_ptr<SharedMemorySegment> Create(const std::string &name, uint64_t capacity);
+
+    // Map a segment created by another process, throws on failure
+    static std::unique_ptr<SharedMemorySegment> Open(const std::string &name);
+
+    // Unmaps, and removes the name if not already gone
+    ~SharedMemorySegment();
+
+    SharedMemorySegment(const SharedMemorySegment &) = delete;
+    SharedMemorySegment &operator=(const SharedMemorySegment &) = delete;
+
+    // Remove the name, the mappings stay valid
+    void Unlink();
+
+    SharedRing &requests() { return *request_ring; }
+    SharedRing &results() { return *result_ring; }
+    const std::string &name() const { return segment_name; }
+
+private:
+    std::string segment_name;
+    void *base = nullptr;
+    size_t size = 0;
+    bool linked = false;
+    std::unique_ptr<SharedRing> request_ring;
+    std::unique_ptr<SharedRing> result_ring;
+
+    SharedMemorySegment(
+        const std::string &name, void *base, size_t size,
+        uint64_t request_capacity, uint64_t result_capacity);
+};
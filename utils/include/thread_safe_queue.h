@@ -1,12 +1,21 @@
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
 #include <queue>
 #include <optional>
 
+// A channel between producer and consumer threads. Optionally bounded, in
+// which case push() blocks while the queue is full. Once closed, pushes are
+// refused and pop() returns nothing when the remaining items are drained.
 template <typename T>
 class ThreadSafeQueue
 {
     std::queue<T> queue_;
+    size_t capacity_ = 0;
+    bool closed_ = false;
     mutable std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
 
     // Moved out of public interface to prevent races between this
     // and pop().
@@ -15,15 +24,33 @@ class ThreadSafeQueue
         return queue_.empty();
     }
 
+    bool full() const
+    {
+        return capacity_ > 0 && queue_.size() >= capacity_;
+    }
+
+    // Take the front item, caller holds the lock and has checked !empty().
+    T take(std::unique_lock<std::mutex> &lock)
+    {
+        T tmp = std::move(queue_.front());
+        queue_.pop();
+        lock.unlock();
+        not_full_.notify_one();
+        return tmp;
+    }
+
 public:
-    ThreadSafeQueue() = default;
+    // A capacity of 0 leaves the queue unbounded.
+    explicit ThreadSafeQueue(size_t capacity = 0) : capacity_(capacity) {}
     ThreadSafeQueue(const ThreadSafeQueue<T> &) = delete;
     ThreadSafeQueue &operator=(const ThreadSafeQueue<T> &) = delete;
 
     ThreadSafeQueue(ThreadSafeQueue<T> &&other)
     {
-        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<std::mutex> lock(other.mutex_);
         queue_ = std::move(other.queue_);
+        capacity_ = other.capacity_;
+        closed_ = other.closed_;
     }
 
     virtual ~ThreadSafeQueue() {}
@@ -34,21 +61,92 @@ public:
         return queue_.size();
     }
 
-    std::optional<T> pop()
+    // Refuse further pushes and wake all waiting threads.
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+    bool closed() const
     {
         std::lock_guard<std::mutex> lock(mutex_);
-        if (queue_.empty())
+        return closed_;
+    }
+
+    // Wait for an item, returns nothing once the queue is closed and empty.
+    std::optional<T> pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return !empty() || closed_; });
+        if (empty())
         {
             return {};
         }
-        T tmp = queue_.front();
-        queue_.pop();
-        return tmp;
+        return take(lock);
     }
 
-    void push(const T &item)
+    // As pop(), but give up after the timeout.
+    template <typename Rep, typename Period>
+    std::optional<T> pop_for(const std::chrono::duration<Rep, Period> &timeout)
     {
-        std::lock_guard<std::mutex> lock(mutex_);
-        queue_.push(item);
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!not_empty_.wait_for(lock, timeout, [this] { return !empty() || closed_; })
+            || empty())
+        {
+            return {};
+        }
+        return take(lock);
+    }
+
+    // Take an item only if one is immediately available.
+    std::optional<T> try_pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (empty())
+        {
+            return {};
+        }
+        return take(lock);
+    }
+
+    // Wait for space, returns false if the queue was closed.
+    bool push(const T &item)
+    {
+        return push(T(item));
+    }
+
+    bool push(T &&item)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            not_full_.wait(lock, [this] { return !full() || closed_; });
+            if (closed_)
+            {
+                return false;
+            }
+            queue_.push(std::move(item));
+        }
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Push only if there is space, returns false if full or closed.
+    bool try_push(T &&item)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (full() || closed_)
+            {
+                return false;
+            }
+            queue_.push(std::move(item));
+        }
+        not_empty_.notify_one();
+        return true;
     }
-};
\ No newline at end of file
+};
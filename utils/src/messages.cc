@@ -16,10 +16,11 @@ bool SequenceRequestToSequence(
         break;
     }
 
-    seq.header = std::string(req.header());
-    seq.id = std::string(req.id());
-    seq.seq = std::string(req.seq());
-    seq.quals = std::string(req.quals());
+    // assign rather than construct, so a reused Sequence keeps its capacity
+    seq.header.assign(req.header());
+    seq.id.assign(req.id());
+    seq.seq.assign(req.seq());
+    seq.quals.assign(req.quals());
 
     return true;
 }
\ No newline at end of file
@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "packed_sequence.h"
+
+namespace {
+
+const uint8_t NOT_ACGT = 4;
+
+// Character to 2 bit code, NOT_ACGT for anything else
+std::array<uint8_t, 256> MakeBaseCodes() {
+    std::array<uint8_t, 256> codes;
+    codes.fill(NOT_ACGT);
+    codes['A'] = codes['a'] = 0;
+    codes['C'] = codes['c'] = 1;
+    codes['G'] = codes['g'] = 2;
+    codes['T'] = codes['t'] = 3;
+    return codes;
+}
+
+// Packed byte to its four bases, in order
+std::array<std::array<char, 4>, 256> MakeByteBases() {
+    std::array<std::array<char, 4>, 256> bases;
+    const char acgt[] = "ACGT";
+    for (int b = 0; b < 256; ++b) {
+        for (int i = 0; i < 4; ++i) {
+            bases[b][i] = acgt[(b >> (2 * i)) & 3];
+        }
+    }
+    return bases;
+}
+
+const std::array<uint8_t, 256> BASE_CODES = MakeBaseCodes();
+const std::array<std::array<char, 4>, 256> BYTE_BASES = MakeByteBases();
+
+}
+
+
+void PackSequence(
+        const char *seq, size_t length, kraken2proto::Kraken2PackedSequence &packed) {
+    packed.set_length(length);
+    std::string &bases = *packed.mutable_bases();
+    bases.assign((length + 3) / 4, '\0');
+    packed.clear_ambiguous_gaps();
+    packed.clear_ambiguous_lengths();
+
+    size_t run_end = 0;
+    for (size_t i = 0; i < length; ++i) {
+        uint8_t code = BASE_CODES[(uint8_t)seq[i]];
+        if (code == NOT_ACGT) {
+            // packed as A, the run marks it ambiguous
+            size_t start = i;
+            while (i + 1 < length && BASE_CODES[(uint8_t)seq[i + 1]] == NOT_ACGT) {
+                ++i;
+            }
+            packed.add_ambiguous_gaps(start - run_end);
+            packed.add_ambiguous_lengths(i + 1 - start);
+            run_end = i + 1;
+            continue;
+        }
+        bases[i / 4] |= code << (2 * (i % 4));
+    }
+}
+
+
+void PackQualityMask(
+        const char *quals, size_t length, int minimum_quality_score,
+        kraken2proto::Kraken2PackedSequence &packed) {
+    std::string &mask = *packed.mutable_low_quality();
+    mask.assign((length + 7) / 8, '\0');
+    bool any = false;
+    for (size_t i = 0; i < length; ++i) {
+        if ((quals[i] - '!') < minimum_quality_score) {
+            mask[i / 8] |= 1 << (i % 8);
+            any = true;
+        }
+    }
+    if (!any) {
+        packed.clear_low_quality();
+    }
+}
+
+
+void UnpackSequence(const kraken2proto::Kraken2PackedSequence &packed, std::string &seq) {
+    // a malformed request is truncated to the bases sent rather than failing
+    // the whole batch
+    const std::string &bases = packed.bases();
+    size_t length = std::min<size_t>(packed.length(), bases.size() * 4);
+    // whole bytes a word at a time, then the remainder
+    seq.resize(length);
+    size_t full = length / 4;
+    for (size_t b = 0; b < full; ++b) {
+        memcpy(&seq[4 * b], BYTE_BASES[(uint8_t)bases[b]].data(), 4);
+    }
+    for (size_t i = 4 * full; i < length; ++i) {
+        seq[i] = BYTE_BASES[(uint8_t)bases[i / 4]][i % 4];
+    }
+
+    size_t pos = 0;
+    int n_runs = std::min(packed.ambiguous_gaps_size(), packed.ambiguous_lengths_size());
+    for (int r = 0; r < n_runs; ++r) {
+        pos += packed.ambiguous_gaps(r);
+        size_t end = std::min<size_t>(pos + packed.ambiguous_lengths(r), length);
+        if (pos < end) {
+            memset(&seq[pos], 'N', end - pos);
+        }
+        pos = end;
+    }
+
+    const std::string &mask = packed.low_quality();
+    size_t masked = std::min(length, mask.size() * 8);
+    for (size_t i = 0; i < masked; ++i) {
+        if (mask[i / 8] & (1 << (i % 8))) {
+            seq[i] = 'x';
+        }
+    }
+}
+
+
+size_t SequenceLength(const kraken2proto::Kraken2SequenceRequest &req) {
+    return req.has_packed() ? req.packed().length() : req.seq().size();
+}
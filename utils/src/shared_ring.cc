@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shared_ring.h"
+#include "utils.h"
+
+namespace {
+
+const uint32_t SEGMENT_MAGIC = 0x6b327368;  // "k2sh"
+const uint32_t SEGMENT_VERSION = 1;
+const uint64_t LENGTH_PREFIX = sizeof(uint32_t);
+
+// Start of the segment, ring data follows at DATA_OFFSET
+struct SegmentHeader {
+    uint32_t magic;
+    uint32_t version;
+    SharedRingHeader rings[2];
+};
+
+const uint64_t DATA_OFFSET = (sizeof(SegmentHeader) + 63) / 64 * 64;
+
+// The two processes share no condition variable, so a waiting side spins
+// briefly then sleeps with a growing pause. An idle ring costs at most a
+// wakeup a millisecond.
+bool Wait(const std::function<bool()> &ready, const CancelledCheck &cancelled) {
+    const int SPINS = 128;
+    const auto MAX_PAUSE = std::chrono::microseconds(1000);
+    auto pause = std::chrono::microseconds(1);
+    for (int i = 0; !ready(); ++i) {
+        if (i < SPINS) {
+            continue;
+        }
+        if (cancelled()) {
+            return false;
+        }
+        std::this_thread::sleep_for(pause);
+        pause = std::min(pause * 2, MAX_PAUSE);
+    }
+    return true;
+}
+
+}
+
+
+void SharedRing::CopyIn(uint64_t pos, const void *src, uint64_t n) {
+    uint64_t offset = pos % capacity;
+    uint64_t first = std::min(n, capacity - offset);
+    std::memcpy(data + offset, src, first);
+    std::memcpy(data, static_cast<const char*>(src) + first, n - first);
+}
+
+
+void SharedRing::CopyOut(uint64_t pos, void *dst, uint64_t n) const {
+    uint64_t offset = pos % capacity;
+    uint64_t first = std::min(n, capacity - offset);
+    std::memcpy(dst, data + offset, first);
+    std::memcpy(static_cast<char*>(dst) + first, data, n - first);
+}
+
+
+bool SharedRing::Write(const google::protobuf::MessageLite &msg, const CancelledCheck &cancelled) {
+    uint64_t size = msg.ByteSizeLong();
+    uint64_t frame = LENGTH_PREFIX + size;
+    if (size > UINT32_MAX || frame > capacity) {
+        return false;
+    }
+    uint64_t head = header->head.load(std::memory_order_relaxed);
+    auto room = [this, head, frame] {
+        return capacity - (head - header->tail.load(std::memory_order_acquire)) >= frame;
+    };
+    if (!Wait(room, cancelled)) {
+        return false;
+    }
+    uint32_t length = size;
+    CopyIn(head, &length, LENGTH_PREFIX);
+    uint64_t offset = (head + LENGTH_PREFIX) % capacity;
+    if (offset + size <= capacity) {
+        msg.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t*>(data + offset));
+    }
+    else {
+        scratch.resize(size);
+        msg.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t*>(&scratch[0]));
+        CopyIn(head + LENGTH_PREFIX, scratch.data(), size);
+    }
+    header->head.store(head + frame, std::memory_order_release);
+    return true;
+}
+
+
+bool SharedRing::WaitForMessage(uint64_t tail, const CancelledCheck &cancelled) {
+    auto available = [this, tail] {
+        return header->head.load(std::memory_order_acquire) != tail
+            || header->closed.load(std::memory_order_acquire);
+    };
+    // head is final once closed is seen, so recheck it for a last message
+    return Wait(available, cancelled)
+        && header->head.load(std::memory_order_acquire) != tail;
+}
+
+
+bool SharedRing::NextMessageSize(uint32_t *size, const CancelledCheck &cancelled) {
+    uint64_t tail = header->tail.load(std::memory_order_relaxed);
+    if (!WaitForMessage(tail, cancelled)) {
+        return false;
+    }
+    CopyOut(tail, size, LENGTH_PREFIX);
+    return true;
+}
+
+
+bool SharedRing::Read(google::protobuf::MessageLite *msg, const CancelledCheck &cancelled) {
+    uint64_t tail = header->tail.load(std::memory_order_relaxed);
+    if (!WaitForMessage(tail, cancelled)) {
+        return false;
+    }
+    uint32_t length;
+    CopyOut(tail, &length, LENGTH_PREFIX);
+    if (length > capacity - LENGTH_PREFIX) {
+        // written by another process, do not trust it
+        return false;
+    }
+    uint64_t offset = (tail + LENGTH_PREFIX) % capacity;
+    bool parsed;
+    if (offset + length <= capacity) {
+        parsed = msg->ParseFromArray(data + offset, length);
+    }
+    else {
+        scratch.resize(length);
+        CopyOut(tail + LENGTH_PREFIX, &scratch[0], length);
+        parsed = msg->ParseFromArray(scratch.data(), length);
+    }
+    header->tail.store(tail + LENGTH_PREFIX + length, std::memory_order_release);
+    return parsed;
+}
+
+
+void SharedRing::Close() {
+    header->closed.store(1, std::memory_order_release);
+}
+
+
+uint64_t SharedRing::MaxMessageSize() const {
+    return std::min<uint64_t>(capacity - LENGTH_PREFIX, UINT32_MAX);
+}
+
+
+SharedMemorySegment::SharedMemorySegment(
+        const std::string &name, void *base, size_t size,
+        uint64_t request_capacity, uint64_t result_capacity)
+: segment_name(name), base(base), size(size), linked(true) {
+    SegmentHeader *segment = static_cast<SegmentHeader*>(base);
+    char *ring_data = static_cast<char*>(base) + DATA_OFFSET;
+    request_ring.reset(new SharedRing(&segment->rings[0], ring_data, request_capacity));
+    result_ring.reset(new SharedRing(&segment->rings[1], ring_data + request_capacity, result_capacity));
+}
+
+
+std::unique_ptr<SharedMemorySegment> SharedMemorySegment::Create(const std::string &name, uint64_t capacity) {
+    if (capacity == 0 || capacity > (UINT64_MAX - DATA_OFFSET) / 2) {
+        throw std::invalid_argument("Shared memory ring capacity is not valid.");
+    }
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        raise_from_errno("Failed to create shared memory segment " + name + ".");
+    }
+    size_t size = DATA_OFFSET + 2 * capacity;
+    if (ftruncate(fd, size) != 0) {
+        int err = errno;
+        close(fd);
+        shm_unlink(name.c_str());
+        raise_from_system_error_code("Failed to size shared memory segment " + name + ".", err);
+    }
+    void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+    if (base == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        raise_from_system_error_code("Failed to map shared memory segment " + name + ".", err);
+    }
+    SegmentHeader *segment = new (base) SegmentHeader;
+    segment->magic = SEGMENT_MAGIC;
+    segment->version = SEGMENT_VERSION;
+    for (SharedRingHeader &ring : segment->rings) {
+        ring.head.store(0);
+        ring.tail.store(0);
+        ring.closed.store(0);
+        ring.capacity = capacity;
+    }
+    return std::unique_ptr<SharedMemorySegment>(new SharedMemorySegment(name, base, size, capacity, capacity));
+}
+
+
+std::unique_ptr<SharedMemorySegment> SharedMemorySegment::Open(const std::string &name) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        raise_from_errno("Failed to open shared memory segment " + name + ".");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        raise_from_system_error_code("Failed to size shared memory segment " + name + ".", err);
+    }
+    size_t size = st.st_size;
+    if (size < DATA_OFFSET) {
+        close(fd);
+        throw std::runtime_error("Shared memory segment " + name + " is too small.");
+    }
+    void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+    if (base == MAP_FAILED) {
+        raise_from_system_error_code("Failed to map shared memory segment " + name + ".", err);
+    }
+    // The ring sizes come from the other process, which can still change
+    // them. Read each once, check the copies fit the mapping and use only
+    // those from here on.
+    SegmentHeader *segment = static_cast<SegmentHeader*>(base);
+    uint64_t request_capacity = *static_cast<volatile uint64_t*>(&segment->rings[0].capacity);
+    uint64_t result_capacity = *static_cast<volatile uint64_t*>(&segment->rings[1].capacity);
+    uint64_t data_size = size - DATA_OFFSET;
+    if (segment->magic != SEGMENT_MAGIC || segment->version != SEGMENT_VERSION
+            || request_capacity == 0 || result_capacity == 0
+            || request_capacity > data_size
+            || result_capacity > data_size - request_capacity) {
+        munmap(base, size);
+        throw std::runtime_error("Shared memory segment " + name + " is not a classification stream.");
+    }
+    return std::unique_ptr<SharedMemorySegment>(
+        new SharedMemorySegment(name, base, size, request_capacity, result_capacity));
+}
+
+
+void SharedMemorySegment::Unlink() {
+    if (linked) {
+        shm_unlink(segment_name.c_str());
+        linked = false;
+    }
+}
+
+
+SharedMemorySegment::~SharedMemorySegment() {
+    Unlink();
+    munmap(base, size);
+}